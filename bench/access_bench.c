@@ -0,0 +1,296 @@
+/*
+ * reader side of bench/access_bench.sh. Replays one access pattern on
+ * tracks of a mounted spotifs and prints time to the first byte, read
+ * latency percentiles and throughput as one line of key=value pairs.
+ *
+ * usage: access_bench PATTERN FILE...
+ *
+ * patterns:
+ *   seq       read files one after another in 128 KiB blocks, as cp does
+ *   stream    read the first file in 4 KiB blocks paced to STREAM_SPEED
+ *             times real time (8), as a player does
+ *   probe     read head and tail of the first file, then seek to the
+ *             middle and a quarter of it, as VLC does when opening a file
+ *   parallel  read all files at once, one thread per file
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#define SEQ_BLOCK (128 * 1024)
+#define STREAM_BLOCK 4096
+#define PROBE_BLOCK (64 * 1024)
+#define PROBE_SPAN (1024 * 1024)
+/* bytes per second of 44.1 kHz 16 bit stereo */
+#define WAVE_RATE 176400
+
+struct reader
+{
+    const char* path;
+    /* latencies of all reads in microseconds */
+    long* latencies;
+    size_t num_latencies;
+    size_t capacity;
+    long long bytes;
+    /* from open to the first byte read */
+    long first_byte_us;
+    int error;
+};
+
+static long long now_us()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static void add_latency(struct reader* reader, long latency)
+{
+    if (reader->num_latencies == reader->capacity) {
+        const size_t capacity = reader->capacity ? reader->capacity * 2 : 1024;
+        long* latencies = realloc(reader->latencies, capacity * sizeof(long));
+
+        if (!latencies) {
+            return;
+        }
+
+        reader->latencies = latencies;
+        reader->capacity = capacity;
+    }
+
+    reader->latencies[reader->num_latencies++] = latency;
+}
+
+/* timed pread, returns number of bytes read */
+static ssize_t timed_read(struct reader* reader, int fd, char* buffer, size_t size, off_t offset, long long opened)
+{
+    const long long start = now_us();
+    const ssize_t bytes = pread(fd, buffer, size, offset);
+    const long long end = now_us();
+
+    if (bytes < 0) {
+        fprintf(stderr, "%s: %s\n", reader->path, strerror(errno));
+        reader->error = 1;
+        return bytes;
+    }
+
+    if (bytes > 0 && reader->first_byte_us < 0) {
+        reader->first_byte_us = end - opened;
+    }
+
+    add_latency(reader, end - start);
+    reader->bytes += bytes;
+
+    return bytes;
+}
+
+static int open_reader(struct reader* reader, long long* opened)
+{
+    int fd;
+
+    reader->first_byte_us = -1;
+    *opened = now_us();
+
+    if ((fd = open(reader->path, O_RDONLY)) < 0) {
+        fprintf(stderr, "%s: %s\n", reader->path, strerror(errno));
+        reader->error = 1;
+    }
+
+    return fd;
+}
+
+static void read_sequential(struct reader* reader)
+{
+    char* buffer = malloc(SEQ_BLOCK);
+    long long opened;
+    off_t offset = 0;
+    ssize_t bytes;
+    int fd;
+
+    if (!buffer || (fd = open_reader(reader, &opened)) < 0) {
+        free(buffer);
+        return;
+    }
+
+    while ((bytes = timed_read(reader, fd, buffer, SEQ_BLOCK, offset, opened)) > 0) {
+        offset += bytes;
+    }
+
+    close(fd);
+    free(buffer);
+}
+
+static void read_stream(struct reader* reader)
+{
+    const char* speed = getenv("STREAM_SPEED");
+    const double rate = WAVE_RATE * (speed ? atof(speed) : 8);
+    char buffer[STREAM_BLOCK];
+    long long opened, start = 0;
+    off_t offset = 0;
+    ssize_t bytes;
+    int fd;
+
+    if ((fd = open_reader(reader, &opened)) < 0) {
+        return;
+    }
+
+    while ((bytes = timed_read(reader, fd, buffer, sizeof(buffer), offset, opened)) > 0) {
+        long long due;
+
+        if (!offset) {
+            start = now_us();
+        }
+
+        offset += bytes;
+
+        /* player consumes data at its bitrate, reads are paced to it */
+        due = start + (long long)(offset / rate * 1000000);
+
+        if (now_us() < due) {
+            usleep(due - now_us());
+        }
+    }
+
+    close(fd);
+}
+
+static void read_probe(struct reader* reader)
+{
+    char* buffer = malloc(PROBE_SPAN);
+    struct stat st;
+    long long opened;
+    off_t positions[2], offset;
+    int fd, i;
+
+    if (!buffer || (fd = open_reader(reader, &opened)) < 0) {
+        free(buffer);
+        return;
+    }
+
+    fstat(fd, &st);
+
+    /* header, then the end where some containers keep their index */
+    timed_read(reader, fd, buffer, PROBE_BLOCK, 0, opened);
+
+    if (st.st_size > PROBE_BLOCK) {
+        timed_read(reader, fd, buffer, PROBE_BLOCK, st.st_size - PROBE_BLOCK, opened);
+    }
+
+    /* user seeks to the middle and back to a quarter */
+    positions[0] = st.st_size / 2;
+    positions[1] = st.st_size / 4;
+
+    for (i = 0; i < 2; i++) {
+        for (offset = 0; offset < PROBE_SPAN && !reader->error; offset += PROBE_BLOCK) {
+            if (timed_read(reader, fd, buffer, PROBE_BLOCK, positions[i] + offset, opened) <= 0) {
+                break;
+            }
+        }
+    }
+
+    close(fd);
+    free(buffer);
+}
+
+static void* parallel_thread(void* arg)
+{
+    read_sequential(arg);
+    return NULL;
+}
+
+static int compare_long(const void* a, const void* b)
+{
+    const long x = *(const long*)a, y = *(const long*)b;
+    return x < y ? -1 : x > y;
+}
+
+static long percentile(const long* values, size_t count, int percent)
+{
+    return count ? values[(count - 1) * percent / 100] : 0;
+}
+
+int main(int argc, char** argv)
+{
+    struct reader* readers;
+    struct reader all = { 0 };
+    pthread_t* threads;
+    long long start, elapsed;
+    int num_readers, i;
+    size_t j;
+
+    if (argc < 3) {
+        fprintf(stderr, "usage: %s seq|stream|probe|parallel FILE...\n", argv[0]);
+        return 1;
+    }
+
+    num_readers = argc - 2;
+    readers = calloc(num_readers, sizeof(struct reader));
+    threads = calloc(num_readers, sizeof(pthread_t));
+
+    if (!readers || !threads) {
+        return 1;
+    }
+
+    for (i = 0; i < num_readers; i++) {
+        readers[i].path = argv[i + 2];
+    }
+
+    start = now_us();
+
+    if (!strcmp(argv[1], "seq")) {
+        for (i = 0; i < num_readers; i++) {
+            read_sequential(&readers[i]);
+        }
+    } else if (!strcmp(argv[1], "stream")) {
+        num_readers = 1;
+        read_stream(&readers[0]);
+    } else if (!strcmp(argv[1], "probe")) {
+        num_readers = 1;
+        read_probe(&readers[0]);
+    } else if (!strcmp(argv[1], "parallel")) {
+        for (i = 0; i < num_readers; i++) {
+            pthread_create(&threads[i], NULL, parallel_thread, &readers[i]);
+        }
+
+        for (i = 0; i < num_readers; i++) {
+            pthread_join(threads[i], NULL);
+        }
+    } else {
+        fprintf(stderr, "unknown pattern %s\n", argv[1]);
+        return 1;
+    }
+
+    elapsed = now_us() - start;
+
+    /* latencies of all readers together, time to first byte is the worst one */
+    all.first_byte_us = 0;
+
+    for (i = 0; i < num_readers; i++) {
+        for (j = 0; j < readers[i].num_latencies; j++) {
+            add_latency(&all, readers[i].latencies[j]);
+        }
+
+        all.bytes += readers[i].bytes;
+        all.error |= readers[i].error;
+
+        if (readers[i].first_byte_us > all.first_byte_us) {
+            all.first_byte_us = readers[i].first_byte_us;
+        }
+    }
+
+    qsort(all.latencies, all.num_latencies, sizeof(long), compare_long);
+
+    printf("pattern=%s files=%d bytes=%lld seconds=%.3f ttfb_ms=%.1f p50_us=%ld p99_us=%ld mb_s=%.1f\n",
+        argv[1], num_readers, all.bytes, elapsed / 1e6, all.first_byte_us / 1e3,
+        percentile(all.latencies, all.num_latencies, 50), percentile(all.latencies, all.num_latencies, 99),
+        elapsed ? all.bytes / 1048576.0 / (elapsed / 1e6) : 0);
+
+    return all.error;
+}
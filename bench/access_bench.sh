@@ -0,0 +1,116 @@
+#!/bin/bash
+#
+# End-to-end access pattern benchmark. spotifs is mounted against the mock
+# libspotify and every pattern runs on tracks it has not buffered yet:
+# sequential cp, paced streaming as moc does, VLC-like probing of head and
+# tail followed by seeks, parallel reads of different tracks and tree walks
+# with find and ls -lR. Each line reports time to the first byte, read
+# latency percentiles, throughput and CPU time spotifs used per GiB read.
+#
+# usage: bench/access_bench.sh [build directory]
+#
+# environment:
+#   MOCK_SPEED      delivery speed of the mock as multiple of real time (50)
+#   TRACK_MS        duration of mock tracks (60000)
+#   PLAYLISTS       number of mock playlists (20)
+#   TRACKS          tracks in every mock playlist (50)
+#   PARALLEL        number of tracks read at once (4)
+#   STREAM_SPEED    pace of streaming reads as multiple of real time (8)
+#   SPOTIFS_OPTIONS extra options passed to spotifs
+
+BUILD=${1:-build}
+SPOTIFS=$BUILD/spotifs
+READER=$BUILD/access_bench
+PARALLEL=${PARALLEL:-4}
+
+export MOCK_SPOTIFY_SPEED=${MOCK_SPEED:-50}
+export MOCK_SPOTIFY_TRACK_MS=${TRACK_MS:-60000}
+export MOCK_SPOTIFY_PLAYLISTS=${PLAYLISTS:-20}
+export MOCK_SPOTIFY_TRACKS=${TRACKS:-50}
+
+MOUNT=$(mktemp -d)
+trap 'fusermount -u "$MOUNT" 2>/dev/null; rmdir "$MOUNT"' EXIT
+
+if [ ! -x "$SPOTIFS" ] || [ ! -x "$READER" ] || [ ! -e "$BUILD/mock/libspotify.so.12" ]; then
+    echo "build spotifs, access_bench and spotify_mock in $BUILD first" >&2
+    exit 1
+fi
+
+LD_LIBRARY_PATH=$BUILD/mock "$SPOTIFS" -u user -p password $SPOTIFS_OPTIONS "$MOUNT" > /dev/null 2>&1 &
+PID=$!
+
+for i in $(seq 600); do
+    if [ -n "$(ls "$MOUNT/library" 2>/dev/null)" ]; then
+        break
+    fi
+    sleep 0.1
+done
+
+if [ -z "$(ls "$MOUNT/library" 2>/dev/null)" ]; then
+    echo "mount failed" >&2
+    kill $PID 2>/dev/null
+    exit 1
+fi
+
+# utime + stime of spotifs in clock ticks
+cpu_ticks() {
+    awk '{ print $14 + $15 }' "/proc/$PID/stat"
+}
+
+# first count tracks of playlist number index
+playlist_tracks() {
+    local playlist
+    playlist=$(ls "$MOUNT/library" | sed -n "$(($1 + 1))p")
+    ls "$MOUNT/library/$playlist" | head -n "$2" | sed "s|^|$MOUNT/library/$playlist/|"
+}
+
+report() {
+    local line=$1 ticks=$2 bytes
+    bytes=$(echo "$line" | sed 's/.*bytes=\([0-9]*\).*/\1/')
+
+    if [ "${bytes:-0}" -gt 0 ]; then
+        printf "%s cpu_s_per_gb=%.2f\n" "$line" "$(echo "$ticks / $(getconf CLK_TCK) / ($bytes / 1073741824)" | bc -l)"
+    else
+        echo "$line"
+    fi
+}
+
+# every pattern gets its own playlist, so nothing is buffered or cached yet
+NEXT_PLAYLIST=0
+
+run_pattern() {
+    local pattern=$1 count=$2 before line
+    local -a files
+    mapfile -t files < <(playlist_tracks "$NEXT_PLAYLIST" "$count")
+    NEXT_PLAYLIST=$((NEXT_PLAYLIST + 1))
+
+    before=$(cpu_ticks)
+    line=$("$READER" "$pattern" "${files[@]}")
+    report "$line" $(($(cpu_ticks) - before))
+}
+
+run_walk() {
+    local name=$1 before start end entries
+    shift
+
+    before=$(cpu_ticks)
+    start=$(date +%s.%N)
+    entries=$("$@" 2>/dev/null | wc -l)
+    end=$(date +%s.%N)
+
+    printf "pattern=%s lines=%d seconds=%.3f cpu_s=%.3f\n" "$name" "$entries" \
+        "$(echo "$end - $start" | bc -l)" "$(echo "($(cpu_ticks) - $before) / $(getconf CLK_TCK)" | bc -l)"
+}
+
+# first walk materializes all playlists, the second one shows cached listings
+run_walk find_cold find "$MOUNT/library"
+run_walk find_warm find "$MOUNT/library"
+run_walk ls_lR ls -lR "$MOUNT/library"
+
+run_pattern seq 2
+run_pattern stream 1
+run_pattern probe 1
+run_pattern parallel "$PARALLEL"
+
+fusermount -u "$MOUNT"
+wait $PID
@@ -0,0 +1,95 @@
+#!/bin/bash
+#
+# Sequential throughput and getattr rate of spotifs under different FUSE
+# option sets. Every set is mounted in turn, first tracks of the first
+# non-empty playlist are read with dd and all entries of the library are
+# stat'ed a few times.
+#
+# usage: bench/options_bench.sh [spotifs binary]
+#
+# environment:
+#   SPOTIFS_USER, SPOTIFS_PASSWORD  credentials passed to spotifs (any value for mock backend)
+#   SPOTIFS_LIBRARY_PATH            directory with libspotify.so.12, point it to the mock
+#                                   backend (build/mock) to measure spotifs itself
+#   TRACKS                          number of tracks read sequentially (3)
+#   STAT_ROUNDS                     how many times the tree is stat'ed (5)
+
+SPOTIFS=${1:-./spotifs}
+SPOTIFS_LIBRARY_PATH=${SPOTIFS_LIBRARY_PATH:-$(dirname "$0")/../libspotify-12.1.51-Linux-x86_64-release/lib}
+TRACKS=${TRACKS:-3}
+STAT_ROUNDS=${STAT_ROUNDS:-5}
+
+OPTION_SETS=(
+    "defaults|"
+    "fuse defaults|-o max_read=131072,max_readahead=131072,entry_timeout=1,attr_timeout=1,negative_timeout=0"
+    "no kernel cache|-o no_kernel_cache"
+    "no splice|-o no_splice_read,no_splice_move"
+    "single thread|-s"
+    "small reads|-o max_read=16384"
+)
+
+MOUNT=$(mktemp -d)
+trap 'fusermount -u "$MOUNT" 2>/dev/null; rmdir "$MOUNT"' EXIT
+
+now() {
+    date +%s.%N
+}
+
+wait_for_library() {
+    for i in $(seq 600); do
+        if [ -n "$(ls "$MOUNT/library" 2>/dev/null)" ]; then
+            return 0
+        fi
+        sleep 0.1
+    done
+    return 1
+}
+
+run_set() {
+    local name=$1 options=$2 pid start end bytes entries playlist
+
+    LD_LIBRARY_PATH=$SPOTIFS_LIBRARY_PATH "$SPOTIFS" -u "${SPOTIFS_USER:-user}" -p "${SPOTIFS_PASSWORD:-password}" \
+        $options "$MOUNT" > /dev/null 2>&1 &
+    pid=$!
+
+    if ! wait_for_library; then
+        echo "$name: mount failed" >&2
+        kill $pid 2>/dev/null
+        return
+    fi
+
+    # playlists are materialized on first listing
+    for playlist in "$MOUNT"/library/*; do
+        if [ -n "$(ls "$playlist")" ]; then
+            break
+        fi
+    done
+
+    bytes=0
+    start=$(now)
+    for track in $(ls "$playlist" | head -n "$TRACKS"); do
+        size=$(dd if="$playlist/$track" of=/dev/null bs=1M 2>&1 | awk '/bytes/ { print $1 }')
+        bytes=$((bytes + size))
+    done
+    end=$(now)
+    throughput=$(echo "$bytes / 1048576 / ($end - $start)" | bc -l)
+
+    entries=$(find "$MOUNT/library" | wc -l)
+    start=$(now)
+    for i in $(seq "$STAT_ROUNDS"); do
+        find "$MOUNT/library" -exec stat --format=%s {} + > /dev/null
+    done
+    end=$(now)
+    rate=$(echo "$entries * $STAT_ROUNDS / ($end - $start)" | bc -l)
+
+    printf "%-16s %10.1f MB/s %12.0f getattr/s\n" "$name" "$throughput" "$rate"
+
+    fusermount -u "$MOUNT"
+    wait $pid
+}
+
+printf "%-16s %15s %22s\n" "options" "sequential" "stat"
+
+for set in "${OPTION_SETS[@]}"; do
+    run_set "${set%%|*}" "${set#*|}"
+done
@@ -0,0 +1,207 @@
+/*
+ * Benchmark of moving file data into a pipe, the way libfuse replies to
+ * reads: pread into a userspace buffer followed by write (what read/memory
+ * based read_buf replies do) versus splice from the file (what fd based
+ * read_buf replies allow with -o splice_read).
+ *
+ * A consumer thread reads the pipe into its own buffer, as the reader of
+ * a FUSE reply gets the data copied. Draining into /dev/null instead would
+ * only move page references, so splice would be measured without any copy.
+ *
+ * usage: splice_bench [file [size in MB [request size in KB]]]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+/* reads bytes from the pipe until all of them arrived */
+struct consumer
+{
+    pthread_t thread;
+    int pipe_out;
+    size_t request;
+    size_t size;
+    int failed;
+};
+
+static double elapsed_ms(const struct timespec* start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (now.tv_sec - start->tv_sec) * 1000.0 + (now.tv_nsec - start->tv_nsec) / 1000000.0;
+}
+
+static int create_file(const char* path, size_t size)
+{
+    const size_t chunk_size = 1024 * 1024;
+    char* chunk = malloc(chunk_size);
+    size_t written = 0;
+    int fd;
+
+    if (!chunk || (fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0) {
+        free(chunk);
+        return -1;
+    }
+
+    /* not zeros, so the file is not sparse */
+    memset(chunk, 0x5a, chunk_size);
+
+    while (written < size) {
+        if (write(fd, chunk, chunk_size) != chunk_size) {
+            close(fd);
+            free(chunk);
+            return -1;
+        }
+
+        written += chunk_size;
+    }
+
+    close(fd);
+    free(chunk);
+
+    return 0;
+}
+
+/* empty the pipe with copies into a buffer, like the reader of the reply */
+static void* consume(void* arg)
+{
+    struct consumer* consumer = arg;
+    char* buffer = malloc(consumer->request);
+    size_t left = consumer->size;
+
+    while (buffer && left) {
+        ssize_t bytes = read(consumer->pipe_out, buffer, consumer->request);
+
+        if (bytes <= 0) {
+            break;
+        }
+
+        left -= bytes;
+    }
+
+    consumer->failed = left != 0;
+    free(buffer);
+
+    return NULL;
+}
+
+static int start_consumer(struct consumer* consumer, int pipe_out, size_t size, size_t request)
+{
+    consumer->pipe_out = pipe_out;
+    consumer->size = size;
+    consumer->request = request;
+    consumer->failed = 0;
+
+    return pthread_create(&consumer->thread, NULL, consume, consumer) ? -1 : 0;
+}
+
+/* time until the consumer got everything */
+static double finish_consumer(struct consumer* consumer, const struct timespec* start, const char* name)
+{
+    pthread_join(consumer->thread, NULL);
+
+    if (consumer->failed) {
+        fprintf(stderr, "%s: consumer didn't get all data\n", name);
+    }
+
+    return elapsed_ms(start);
+}
+
+static double copy_memory(int fd, int pipe_in, int pipe_out, size_t size, size_t request)
+{
+    char* buffer = malloc(request);
+    struct consumer consumer;
+    struct timespec start;
+    off_t offset = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if (!buffer || start_consumer(&consumer, pipe_out, size, request) < 0) {
+        free(buffer);
+        return 0;
+    }
+
+    while (offset < size) {
+        ssize_t bytes = pread(fd, buffer, request, offset);
+
+        if (bytes <= 0 || write(pipe_in, buffer, bytes) != bytes) {
+            perror("memcpy");
+            break;
+        }
+
+        offset += bytes;
+    }
+
+    free(buffer);
+    return finish_consumer(&consumer, &start, "memcpy");
+}
+
+static double copy_splice(int fd, int pipe_in, int pipe_out, size_t size, size_t request)
+{
+    struct consumer consumer;
+    struct timespec start;
+    loff_t offset = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if (start_consumer(&consumer, pipe_out, size, request) < 0) {
+        return 0;
+    }
+
+    while (offset < size) {
+        ssize_t bytes = splice(fd, &offset, pipe_in, NULL, request, SPLICE_F_MOVE);
+
+        if (bytes <= 0) {
+            perror("splice");
+            break;
+        }
+    }
+
+    return finish_consumer(&consumer, &start, "splice");
+}
+
+int main(int argc, char **argv)
+{
+    const char* path = argc > 1 ? argv[1] : "splice_bench.dat";
+    const size_t size = (argc > 2 ? strtoul(argv[2], NULL, 10) : 2048) * 1024 * 1024;
+    const size_t request = (argc > 3 ? strtoul(argv[3], NULL, 10) : 128) * 1024;
+    int pipes[2], fd;
+    double memory, spliced;
+
+    if (create_file(path, size) < 0) {
+        fprintf(stderr, "can't create '%s': %s\n", path, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    if (pipe(pipes) < 0 || (fd = open(path, O_RDONLY)) < 0) {
+        perror("open");
+        unlink(path);
+        return EXIT_FAILURE;
+    }
+
+    /* room for whole request, as /dev/fuse replies */
+    fcntl(pipes[1], F_SETPIPE_SZ, request);
+
+    /* both runs read from the page cache, warm it up first */
+    copy_splice(fd, pipes[1], pipes[0], size, request);
+
+    memory = copy_memory(fd, pipes[1], pipes[0], size, request);
+    spliced = copy_splice(fd, pipes[1], pipes[0], size, request);
+
+    printf("%zu MB in %zu KB requests\n", size / 1024 / 1024, request / 1024);
+    printf("memcpy: %.2f ms, %.1f MB/s\n", memory, size / 1024.0 / 1024.0 / (memory / 1000.0));
+    printf("splice: %.2f ms, %.1f MB/s\n", spliced, size / 1024.0 / 1024.0 / (spliced / 1000.0));
+
+    close(fd);
+    unlink(path);
+
+    return EXIT_SUCCESS;
+}
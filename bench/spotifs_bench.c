@@ -0,0 +1,311 @@
+/*
+ * Microbenchmarks of code running on every FUSE call: building sfs trees,
+ * path lookups at different depths and fan-outs, spotify_read of buffered
+ * data and wave header generation. Every result is one line of key=value
+ * pairs, so runs can be compared by scripts.
+ *
+ * usage: spotifs_bench [entries...]    (1000 10000 100000 1000000)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include "sfs.h"
+#include "spotify.h"
+#include "wave.h"
+
+/* every measurement is repeated until it runs at least this long */
+#define MIN_RUN_NS 50000000LL
+/* number of paths looked up in lookup benchmarks */
+#define MAX_SAMPLES 100000
+
+static long long now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void report(const char* benchmark, const char* variant, long entries, long long ops, long long ns, long long bytes)
+{
+    printf("benchmark=%s variant=%s entries=%ld ops=%lld ns_per_op=%.1f", benchmark, variant, entries, ops, (double)ns / ops);
+
+    if (bytes) {
+        printf(" mb_s=%.1f", bytes / 1048576.0 / (ns / 1e9));
+    }
+
+    printf("\n");
+}
+
+/* single directory with all entries, worst case for appending */
+static void build_flat(struct sfs_entry* root, long entries)
+{
+    struct sfs_entry* dir = sfs_add_subdirectory(root, "flat");
+    char name[64];
+    long i;
+
+    for (i = 0; i < entries; i++) {
+        snprintf(name, sizeof(name), "track %ld.wav", i);
+        sfs_add_child(dir, name, sfs_track);
+    }
+}
+
+/* library-like tree of playlists with given number of tracks each */
+static void build_library(struct sfs_entry* root, long entries, long tracks_per_playlist)
+{
+    struct sfs_entry *library, *playlist = NULL;
+    char name[64];
+    long i;
+
+    library = sfs_add_child(root, "library", sfs_directory | sfs_container);
+
+    for (i = 0; i < entries; i++) {
+        if (!(i % tracks_per_playlist)) {
+            snprintf(name, sizeof(name), "playlist %ld", i / tracks_per_playlist);
+            playlist = sfs_add_child(library, name, sfs_directory | sfs_playlist);
+        }
+
+        snprintf(name, sizeof(name), "track %ld.wav", i);
+        sfs_add_child(playlist, name, sfs_track);
+    }
+}
+
+static void bench_insert(long entries)
+{
+    struct sfs_entry root = { .name = "/", .type = sfs_directory };
+    long long start;
+
+    start = now_ns();
+    build_flat(&root, entries);
+    report("sfs_add_child", "flat", entries, entries, now_ns() - start, 0);
+    sfs_remove_children(&root);
+
+    start = now_ns();
+    build_library(&root, entries, 10000);
+    report("sfs_add_child", "playlists_of_10000", entries, entries, now_ns() - start, 0);
+    sfs_remove_children(&root);
+
+    start = now_ns();
+    build_library(&root, entries, 100);
+    report("sfs_add_child", "playlists_of_100", entries, entries, now_ns() - start, 0);
+    sfs_remove_children(&root);
+}
+
+/* tree of given depth with fan-out entries in every directory */
+static void build_tree(struct sfs_entry* dir, int depth, long fanout)
+{
+    char name[32];
+    long i;
+
+    for (i = 0; i < fanout; i++) {
+        snprintf(name, sizeof(name), "%s%ld", depth > 1 ? "dir" : "track", i);
+
+        if (depth > 1) {
+            build_tree(sfs_add_child(dir, name, sfs_directory), depth - 1, fanout);
+        } else {
+            sfs_add_child(dir, name, sfs_track);
+        }
+    }
+}
+
+/* random path of a leaf in tree built by build_tree */
+static void leaf_path(char* path, size_t size, int depth, long fanout)
+{
+    size_t used = 0;
+    int level;
+
+    for (level = depth; level > 0 && used < size; level--) {
+        used += snprintf(path + used, size - used, "/%s%ld", level > 1 ? "dir" : "track", random() % fanout);
+    }
+}
+
+static void bench_lookup(long entries)
+{
+    int depth;
+
+    for (depth = 1; depth <= 3; depth++) {
+        struct sfs_entry root = { .name = "/", .type = sfs_directory };
+        const long fanout = (long)ceil(pow(entries, 1.0 / depth));
+        const long samples = entries < MAX_SAMPLES ? entries : MAX_SAMPLES;
+        char variant[64];
+        char (*paths)[64];
+        long long start, ops = 0;
+        long i;
+
+        if (!(paths = malloc(samples * sizeof(*paths)))) {
+            return;
+        }
+
+        build_tree(&root, depth, fanout);
+
+        for (i = 0; i < samples; i++) {
+            leaf_path(paths[i], sizeof(paths[i]), depth, fanout);
+        }
+
+        /* the first lookup of a path walks the tree, later ones hit the path cache */
+        snprintf(variant, sizeof(variant), "depth_%d_fanout_%ld_walk", depth, fanout);
+        start = now_ns();
+
+        for (i = 0; i < samples; i++) {
+            sfs_get(&root, paths[i]);
+        }
+
+        report("sfs_get", variant, entries, samples, now_ns() - start, 0);
+
+        snprintf(variant, sizeof(variant), "depth_%d_fanout_%ld_cached", depth, fanout);
+        start = now_ns();
+
+        do {
+            for (i = 0; i < samples; i++) {
+                sfs_get(&root, paths[i]);
+            }
+
+            ops += samples;
+        } while (now_ns() - start < MIN_RUN_NS);
+
+        report("sfs_get", variant, entries, ops, now_ns() - start, 0);
+
+        sfs_remove_children(&root);
+        free(paths);
+    }
+}
+
+/* completely buffered track, as it is after streaming finished */
+static int init_track(struct track* track, int duration)
+{
+    char* data;
+    size_t i;
+
+    memset(track, 0, sizeof(struct track));
+    track->duration = duration;
+    track->channels = 2;
+    track->sample_rate = 44100;
+    track->cache_fd = -1;
+    pthread_mutex_init(&track->lock, NULL);
+
+    if (buffer_init(&track->buffer, wave_size(2, 2, 44100, duration)) < 0
+        || !(data = malloc(track->buffer.capacity))) {
+        return -1;
+    }
+
+    for (i = 0; i < track->buffer.capacity; i++) {
+        data[i] = i * 31;
+    }
+
+    buffer_write(&track->buffer, data, track->buffer.capacity);
+    free(data);
+
+    track->size = track->buffer.capacity + wave_header_size();
+    track->published_start = 0;
+    track->published_end = track->buffer.capacity;
+
+    return 0;
+}
+
+static void bench_read_track(struct track* track, const char* variant, size_t size)
+{
+    char name[64];
+    char* out = malloc(size);
+    const off_t last = track->size - size;
+    long long start, ops = 0;
+    off_t offset = wave_header_size();
+
+    if (!out) {
+        return;
+    }
+
+    start = now_ns();
+
+    do {
+        spotify_read(NULL, track, offset, size, out, 0);
+        ops++;
+
+        if ((offset += size) > last) {
+            offset = wave_header_size();
+        }
+    } while (now_ns() - start < MIN_RUN_NS);
+
+    snprintf(name, sizeof(name), "%s_%zu", variant, size);
+    report("spotify_read", name, 0, ops, now_ns() - start, ops * size);
+
+    free(out);
+}
+
+static void bench_read()
+{
+    static const size_t sizes[] = { 4096, 16384, 131072, 1048576 };
+    struct track track;
+    long long start, ops = 0;
+    char out[64];
+    size_t i;
+
+    if (init_track(&track, 60000) < 0) {
+        return;
+    }
+
+    /* data inside the published extent is copied without locking */
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        bench_read_track(&track, "published", sizes[i]);
+    }
+
+    /* behind it, presence is checked under the track lock */
+    track.published_end = 0;
+
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        bench_read_track(&track, "locked", sizes[i]);
+    }
+
+    /* players read the header first */
+    start = now_ns();
+
+    do {
+        spotify_read(NULL, &track, 0, wave_header_size(), out, 0);
+        ops++;
+    } while (now_ns() - start < MIN_RUN_NS);
+
+    report("spotify_read", "header", 0, ops, now_ns() - start, 0);
+
+    buffer_release(&track.buffer);
+}
+
+static void bench_header()
+{
+    long long start, ops = 0;
+    char header[64];
+
+    start = now_ns();
+
+    do {
+        wave_standard_header(ops & 0xffffff, header);
+        ops++;
+    } while (now_ns() - start < MIN_RUN_NS);
+
+    report("wave_standard_header", "default", 0, ops, now_ns() - start, 0);
+}
+
+int main(int argc, char **argv)
+{
+    static const long default_entries[] = { 1000, 10000, 100000, 1000000 };
+    int i;
+
+    srandom(1);
+
+    if (argc > 1) {
+        for (i = 1; i < argc; i++) {
+            bench_insert(atol(argv[i]));
+            bench_lookup(atol(argv[i]));
+        }
+    } else {
+        for (i = 0; i < sizeof(default_entries) / sizeof(default_entries[0]); i++) {
+            bench_insert(default_entries[i]);
+            bench_lookup(default_entries[i]);
+        }
+    }
+
+    bench_read();
+    bench_header();
+
+    return 0;
+}
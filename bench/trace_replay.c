@@ -0,0 +1,461 @@
+/*
+ * replay trace recorded with spotifs -o trace=FILE against a mounted
+ * spotifs, usually one backed by the mock libspotify. Operations of every
+ * recorded FUSE thread are issued by their own thread with the original
+ * spacing divided by speed (0 issues them as fast as possible). Recorded
+ * and replayed latencies are printed per operation.
+ *
+ * usage: trace_replay [-s speed] TRACE MOUNTPOINT
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "trace.h"
+
+struct op
+{
+    /* ino is replaced by the index of its path */
+    struct trace_record record;
+    const char* name;
+    /* replayed latency in us */
+    long latency;
+};
+
+/* file of an inode opened during replay, shared by all threads */
+struct open_file
+{
+    uint64_t ino;
+    int fd;
+    int refs;
+    struct open_file* next;
+};
+
+struct replay_thread
+{
+    pthread_t thread;
+    struct op** ops;
+    size_t num_ops;
+    size_t capacity;
+};
+
+static const char* g_mountpoint;
+static double g_speed = 1;
+static long long g_start;
+
+/* paths of TRACE_PATH records in order, loaded ops refer to them by index, 0 is none */
+static char** g_paths = NULL;
+static size_t g_num_paths = 0;
+static size_t g_paths_capacity = 0;
+
+/* inode number -> index of its last path, while the trace is loaded */
+static size_t* g_inode_paths = NULL;
+static size_t g_num_inodes = 0;
+
+static struct open_file* g_open_files = NULL;
+static pthread_mutex_t g_open_files_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char* g_op_names[TRACE_NUM_OPS] = {
+    "path", "lookup", "getattr", "readdir", "open", "release", "read"
+};
+
+static long long now_us()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/* number gets a new path, also when it was forgotten and reused */
+static void set_path(uint64_t ino, const char* path)
+{
+    if (ino >= g_num_inodes) {
+        const size_t count = ino * 2 + 1;
+        size_t* inode_paths = realloc(g_inode_paths, count * sizeof(size_t));
+
+        if (!inode_paths) {
+            return;
+        }
+
+        memset(inode_paths + g_num_inodes, 0, (count - g_num_inodes) * sizeof(size_t));
+        g_inode_paths = inode_paths;
+        g_num_inodes = count;
+    }
+
+    if (g_num_paths + 1 >= g_paths_capacity) {
+        const size_t capacity = g_paths_capacity ? g_paths_capacity * 2 : 1024;
+        char** paths = realloc(g_paths, capacity * sizeof(char*));
+
+        if (!paths) {
+            return;
+        }
+
+        g_paths = paths;
+        g_paths_capacity = capacity;
+    }
+
+    /* index 0 stays empty */
+    if (!g_num_paths) {
+        g_paths[g_num_paths++] = NULL;
+    }
+
+    if ((g_paths[g_num_paths] = strdup(path))) {
+        g_inode_paths[ino] = g_num_paths++;
+    }
+}
+
+/* index of the path the number has now, 0 if it has none */
+static size_t path_index(uint64_t ino)
+{
+    return ino < g_num_inodes ? g_inode_paths[ino] : 0;
+}
+
+/* path with the index inside the mount, name is appended if given */
+static int mount_path(uint64_t ino, const char* name, char* path, size_t size)
+{
+    if (ino >= g_num_paths || !g_paths[ino]) {
+        return -1;
+    }
+
+    snprintf(path, size, "%s%s%s%s", g_mountpoint, g_paths[ino],
+        name && strcmp(g_paths[ino], "/") ? "/" : "", name ? name : "");
+    return 0;
+}
+
+/* fd of inode, the file is opened by the first open record */
+static int get_file(uint64_t ino, int open_file)
+{
+    struct open_file* file;
+    char path[PATH_MAX];
+    int fd = -1;
+
+    pthread_mutex_lock(&g_open_files_lock);
+
+    for (file = g_open_files; file && file->ino != ino; file = file->next);
+
+    if (file) {
+        file->refs += open_file;
+        fd = file->fd;
+    } else if (mount_path(ino, NULL, path, sizeof(path)) == 0 && (fd = open(path, O_RDONLY)) >= 0) {
+        if ((file = malloc(sizeof(struct open_file)))) {
+            file->ino = ino;
+            file->fd = fd;
+            /* reads of files opened before the trace started keep them open */
+            file->refs = open_file;
+            file->next = g_open_files;
+            g_open_files = file;
+        }
+    }
+
+    pthread_mutex_unlock(&g_open_files_lock);
+
+    return fd;
+}
+
+static void put_file(uint64_t ino)
+{
+    struct open_file** link;
+
+    pthread_mutex_lock(&g_open_files_lock);
+
+    for (link = &g_open_files; *link && (*link)->ino != ino; link = &(*link)->next);
+
+    if (*link && --(*link)->refs <= 0) {
+        struct open_file* file = *link;
+
+        *link = file->next;
+        close(file->fd);
+        free(file);
+    }
+
+    pthread_mutex_unlock(&g_open_files_lock);
+}
+
+static void replay(struct op* op)
+{
+    const struct trace_record* record = &op->record;
+    char path[PATH_MAX];
+    struct stat st;
+    char* buffer;
+    int fd;
+
+    switch (record->op) {
+    case TRACE_LOOKUP:
+        if (mount_path(record->ino, op->name, path, sizeof(path)) == 0) {
+            stat(path, &st);
+        }
+        break;
+
+    case TRACE_GETATTR:
+        if (mount_path(record->ino, NULL, path, sizeof(path)) == 0) {
+            stat(path, &st);
+        }
+        break;
+
+    case TRACE_READDIR:
+        /* the whole listing is read when its first page was requested */
+        if (!record->offset && mount_path(record->ino, NULL, path, sizeof(path)) == 0) {
+            DIR* dir = opendir(path);
+
+            if (dir) {
+                while (readdir(dir));
+                closedir(dir);
+            }
+        }
+        break;
+
+    case TRACE_OPEN:
+        get_file(record->ino, 1);
+        break;
+
+    case TRACE_RELEASE:
+        put_file(record->ino);
+        break;
+
+    case TRACE_READ:
+        if ((fd = get_file(record->ino, 0)) >= 0 && (buffer = malloc(record->size))) {
+            if (pread(fd, buffer, record->size, record->offset) < 0) {
+                fprintf(stderr, "read %s: %s\n", g_paths[record->ino], strerror(errno));
+            }
+
+            free(buffer);
+        }
+        break;
+    }
+}
+
+static void* replay_thread(void* arg)
+{
+    struct replay_thread* thread = arg;
+    size_t i;
+
+    for (i = 0; i < thread->num_ops; i++) {
+        struct op* op = thread->ops[i];
+        long long start;
+
+        if (g_speed > 0) {
+            const long long due = g_start + (long long)(op->record.time / 1000 / g_speed);
+
+            if (now_us() < due) {
+                usleep(due - now_us());
+            }
+        }
+
+        start = now_us();
+        replay(op);
+        op->latency = now_us() - start;
+    }
+
+    return NULL;
+}
+
+static int compare_time(const void* a, const void* b)
+{
+    const uint64_t x = ((const struct op*)a)->record.time, y = ((const struct op*)b)->record.time;
+    return x < y ? -1 : x > y;
+}
+
+static int compare_long(const void* a, const void* b)
+{
+    const long x = *(const long*)a, y = *(const long*)b;
+    return x < y ? -1 : x > y;
+}
+
+static long percentile(long* values, size_t count, int percent)
+{
+    return count ? values[(count - 1) * percent / 100] : 0;
+}
+
+static void print_summary(struct op* ops, size_t num_ops)
+{
+    long* recorded = malloc(num_ops * sizeof(long));
+    long* replayed = malloc(num_ops * sizeof(long));
+    int op;
+    size_t i;
+
+    if (!recorded || !replayed) {
+        return;
+    }
+
+    printf("%-8s %8s %14s %14s %14s %14s\n", "op", "count", "recorded p50", "recorded p99", "replayed p50", "replayed p99");
+
+    for (op = TRACE_LOOKUP; op < TRACE_NUM_OPS; op++) {
+        size_t count = 0;
+
+        for (i = 0; i < num_ops; i++) {
+            if (ops[i].record.op == op) {
+                recorded[count] = ops[i].record.latency;
+                replayed[count] = ops[i].latency;
+                count++;
+            }
+        }
+
+        if (!count) {
+            continue;
+        }
+
+        qsort(recorded, count, sizeof(long), compare_long);
+        qsort(replayed, count, sizeof(long), compare_long);
+
+        printf("%-8s %8zu %12ldus %12ldus %12ldus %12ldus\n", g_op_names[op], count,
+            percentile(recorded, count, 50), percentile(recorded, count, 99),
+            percentile(replayed, count, 50), percentile(replayed, count, 99));
+    }
+
+    free(recorded);
+    free(replayed);
+}
+
+/* read all records, path records are applied and dropped */
+static struct op* load_trace(const char* file, size_t* num_ops)
+{
+    struct trace_header header;
+    struct trace_record record;
+    struct op* ops = NULL;
+    size_t capacity = 0;
+    FILE* trace;
+
+    *num_ops = 0;
+
+    if (!(trace = fopen(file, "rb"))) {
+        fprintf(stderr, "%s: %s\n", file, strerror(errno));
+        return NULL;
+    }
+
+    if (fread(&header, sizeof(header), 1, trace) != 1 || memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic))
+        || header.version != TRACE_VERSION || header.record_size != sizeof(struct trace_record)) {
+        fprintf(stderr, "%s: not a spotifs trace\n", file);
+        fclose(trace);
+        return NULL;
+    }
+
+    while (fread(&record, sizeof(record), 1, trace) == 1) {
+        char* name = NULL;
+
+        if (record.name_length) {
+            if (!(name = malloc(record.name_length + 1)) || fread(name, record.name_length, 1, trace) != 1) {
+                free(name);
+                break;
+            }
+
+            name[record.name_length] = 0;
+        }
+
+        if (record.op == TRACE_PATH) {
+            set_path(record.ino, name ? name : "/");
+            free(name);
+            continue;
+        }
+
+        if (*num_ops == capacity) {
+            struct op* more;
+
+            capacity = capacity ? capacity * 2 : 4096;
+
+            if (!(more = realloc(ops, capacity * sizeof(struct op)))) {
+                free(name);
+                break;
+            }
+
+            ops = more;
+        }
+
+        /* numbers are reused, the op refers to the path its number had when it was recorded */
+        ops[*num_ops].record = record;
+        ops[*num_ops].record.ino = path_index(record.ino);
+        ops[*num_ops].name = name;
+        ops[*num_ops].latency = 0;
+        (*num_ops)++;
+    }
+
+    fclose(trace);
+
+    return ops;
+}
+
+int main(int argc, char** argv)
+{
+    struct replay_thread* threads = NULL;
+    struct op* ops;
+    size_t num_ops, i;
+    int num_threads = 0, opt, t;
+    long long elapsed;
+
+    while ((opt = getopt(argc, argv, "s:")) != -1) {
+        if (opt == 's') {
+            g_speed = atof(optarg);
+        } else {
+            return 1;
+        }
+    }
+
+    if (argc - optind != 2) {
+        fprintf(stderr, "usage: %s [-s speed] TRACE MOUNTPOINT\n", argv[0]);
+        return 1;
+    }
+
+    g_mountpoint = argv[optind + 1];
+
+    if (!(ops = load_trace(argv[optind], &num_ops))) {
+        return 1;
+    }
+
+    /* records are written when operations finish, replay goes in order of their start */
+    qsort(ops, num_ops, sizeof(struct op), compare_time);
+
+    /* operations in order of recorded threads */
+    for (i = 0; i < num_ops; i++) {
+        const int index = ops[i].record.thread;
+        struct replay_thread* thread;
+
+        if (index >= num_threads) {
+            struct replay_thread* more = realloc(threads, (index + 1) * sizeof(struct replay_thread));
+
+            if (!more) {
+                return 1;
+            }
+
+            memset(more + num_threads, 0, (index + 1 - num_threads) * sizeof(struct replay_thread));
+            threads = more;
+            num_threads = index + 1;
+        }
+
+        thread = &threads[index];
+
+        if (thread->num_ops == thread->capacity) {
+            thread->capacity = thread->capacity ? thread->capacity * 2 : 256;
+
+            if (!(thread->ops = realloc(thread->ops, thread->capacity * sizeof(struct op*)))) {
+                return 1;
+            }
+        }
+
+        thread->ops[thread->num_ops++] = &ops[i];
+    }
+
+    g_start = now_us();
+
+    for (t = 0; t < num_threads; t++) {
+        pthread_create(&threads[t].thread, NULL, replay_thread, &threads[t]);
+    }
+
+    for (t = 0; t < num_threads; t++) {
+        pthread_join(threads[t].thread, NULL);
+    }
+
+    elapsed = now_us() - g_start;
+
+    printf("replayed %zu operations of %d threads in %.3f s (recorded %.3f s)\n", num_ops, num_threads,
+        elapsed / 1e6, num_ops ? ops[num_ops - 1].record.time / 1e9 : 0);
+    print_summary(ops, num_ops);
+
+    return 0;
+}
@@ -0,0 +1,755 @@
+/*
+ * stand-in libspotify.so.12 for offline testing and benchmarks. It
+ * implements only the calls spotifs uses: a generated library of playlists
+ * is "loaded" after configurable latencies and tracks are delivered as
+ * deterministic PCM at a configurable multiple of real time.
+ *
+ * configuration is read from environment when the session is created:
+ *   MOCK_SPOTIFY_PLAYLISTS      number of playlists (10)
+ *   MOCK_SPOTIFY_TRACKS         tracks in every playlist (20)
+ *   MOCK_SPOTIFY_TRACK_MS       duration of a track (180000)
+ *   MOCK_SPOTIFY_LOGIN_MS       login latency (0)
+ *   MOCK_SPOTIFY_CONTAINER_MS   container load latency after login (0)
+ *   MOCK_SPOTIFY_PLAYLIST_MS    playlist load latency after set in RAM (0)
+ *   MOCK_SPOTIFY_METADATA_MS    track metadata load latency, player load fails with IS_LOADING meanwhile (0)
+ *   MOCK_SPOTIFY_SPEED          delivery rate as multiple of real time, 0 is unlimited (1)
+ *   MOCK_SPOTIFY_CHUNK_FRAMES   frames passed to one music_delivery call (2048)
+ *
+ * Callbacks except music_delivery are called from sp_session_process_events,
+ * as libspotify does. The delivery thread queues end_of_track and notifies
+ * the main thread; a load, seek or unload before it's processed drops it.
+ * Load, seek and unload wait for music_delivery in progress, so no frames
+ * of the previous track or position are delivered after they return.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <libspotify/api.h>
+
+#define MOCK_SAMPLE_RATE 44100
+#define MOCK_CHANNELS 2
+#define MOCK_MAX_CALLBACKS 4
+/* how long delivery waits when music_delivery doesn't consume anything */
+#define MOCK_BACKOFF_MS 10
+/* timeout returned by process_events when nothing is scheduled */
+#define MOCK_IDLE_MS 1000
+
+struct mock_callbacks
+{
+    int count;
+    void* callbacks[MOCK_MAX_CALLBACKS];
+    void* userdata[MOCK_MAX_CALLBACKS];
+};
+
+struct sp_track
+{
+    int id;
+    int duration;
+    char name[32];
+    /* player can load the track, guarded by session lock */
+    int metadata_loaded;
+};
+
+struct sp_playlist
+{
+    char name[32];
+    sp_track* tracks;
+    int num_tracks;
+    int loaded;
+    /* monotonic ms when load finishes, 0 if not loading */
+    long long load_time;
+    struct mock_callbacks callbacks;
+};
+
+struct sp_playlistcontainer
+{
+    sp_playlist* playlists;
+    int num_playlists;
+    int loaded;
+    long long load_time;
+    struct mock_callbacks callbacks;
+};
+
+struct sp_link
+{
+    char uri[64];
+};
+
+struct mock_config
+{
+    int playlists;
+    int tracks;
+    int track_ms;
+    int login_ms;
+    int container_ms;
+    int playlist_ms;
+    int metadata_ms;
+    double speed;
+    int chunk_frames;
+};
+
+struct sp_session
+{
+    sp_session_callbacks callbacks;
+    void* userdata;
+    int unload_playlists;
+    struct mock_config config;
+
+    sp_connectionstate state;
+    long long login_time;
+    /* track with metadata being loaded and when it finishes, one at a time */
+    sp_track* metadata_track;
+    long long metadata_time;
+    sp_playlistcontainer container;
+
+    /* player, guarded by lock */
+    sp_track* track;
+    int playing;
+    long long position;
+    long long frames;
+    /* bumped by load and seek, so delivery in progress is discarded */
+    unsigned int generation;
+    int end_sent;
+    /* end_of_track is due, called by process_events */
+    int end_pending;
+    /* pacing reference, set when playing starts or position changes */
+    long long pace_time;
+    long long pace_position;
+    pthread_t delivery;
+    pthread_cond_t player_cond;
+    /* frames were taken for music_delivery which didn't return yet, signaled by delivered_cond */
+    int delivering;
+    pthread_cond_t delivered_cond;
+
+    pthread_mutex_t lock;
+};
+
+static long long now_ms()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static int env_int(const char* name, int value)
+{
+    const char* s = getenv(name);
+    return s ? atoi(s) : value;
+}
+
+static void read_config(struct mock_config* config)
+{
+    const char* speed = getenv("MOCK_SPOTIFY_SPEED");
+
+    config->playlists = env_int("MOCK_SPOTIFY_PLAYLISTS", 10);
+    config->tracks = env_int("MOCK_SPOTIFY_TRACKS", 20);
+    config->track_ms = env_int("MOCK_SPOTIFY_TRACK_MS", 180000);
+    config->login_ms = env_int("MOCK_SPOTIFY_LOGIN_MS", 0);
+    config->container_ms = env_int("MOCK_SPOTIFY_CONTAINER_MS", 0);
+    config->playlist_ms = env_int("MOCK_SPOTIFY_PLAYLIST_MS", 0);
+    config->metadata_ms = env_int("MOCK_SPOTIFY_METADATA_MS", 0);
+    config->speed = speed ? atof(speed) : 1;
+    config->chunk_frames = env_int("MOCK_SPOTIFY_CHUNK_FRAMES", 2048);
+
+    if (config->chunk_frames <= 0) {
+        config->chunk_frames = 2048;
+    }
+}
+
+static void add_callbacks(struct mock_callbacks* list, void* callbacks, void* userdata)
+{
+    if (list->count < MOCK_MAX_CALLBACKS) {
+        list->callbacks[list->count] = callbacks;
+        list->userdata[list->count] = userdata;
+        list->count++;
+    }
+}
+
+static void remove_callbacks(struct mock_callbacks* list, void* callbacks, void* userdata)
+{
+    int i;
+
+    for (i = 0; i < list->count; i++) {
+        if (list->callbacks[i] == callbacks && list->userdata[i] == userdata) {
+            list->count--;
+            memmove(list->callbacks + i, list->callbacks + i + 1, (list->count - i) * sizeof(void*));
+            memmove(list->userdata + i, list->userdata + i + 1, (list->count - i) * sizeof(void*));
+            return;
+        }
+    }
+}
+
+static void notify_main_thread(sp_session* session)
+{
+    if (session->callbacks.notify_main_thread) {
+        session->callbacks.notify_main_thread(session);
+    }
+}
+
+/* same data for the same track and position, so reads can be verified */
+static void fill_frames(int16_t* frames, const sp_track* track, long long position, int count)
+{
+    int i;
+
+    for (i = 0; i < count; i++) {
+        const int16_t sample = (int16_t)((position + i) * 31 + track->id * 7919);
+
+        frames[i * MOCK_CHANNELS] = sample;
+        frames[i * MOCK_CHANNELS + 1] = (int16_t)~sample;
+    }
+}
+
+static void reset_pace(sp_session* session)
+{
+    session->pace_time = now_ms();
+    session->pace_position = session->position;
+}
+
+/* wait on player_cond until ms (monotonic) or signal, lock is held */
+static void wait_until(sp_session* session, long long ms)
+{
+    struct timespec deadline;
+
+    deadline.tv_sec = ms / 1000;
+    deadline.tv_nsec = (ms % 1000) * 1000000;
+    pthread_cond_timedwait(&session->player_cond, &session->lock, &deadline);
+}
+
+/* frames taken before a change of the player are not delivered after it, lock is held */
+static void wait_for_delivery(sp_session* session)
+{
+    while (session->delivering) {
+        pthread_cond_wait(&session->delivered_cond, &session->lock);
+    }
+}
+
+static void* delivery_thread(void* arg)
+{
+    sp_session* session = arg;
+    const sp_audioformat format = { SP_SAMPLETYPE_INT16_NATIVE_ENDIAN, MOCK_SAMPLE_RATE, MOCK_CHANNELS };
+    int16_t* frames = malloc(session->config.chunk_frames * MOCK_CHANNELS * sizeof(int16_t));
+
+    if (!frames) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&session->lock);
+
+    for (;;) {
+        unsigned int generation;
+        int count, consumed;
+
+        if (!session->track || !session->playing || session->position >= session->frames) {
+            pthread_cond_wait(&session->player_cond, &session->lock);
+            continue;
+        }
+
+        /* frames are released at speed multiple of real time */
+        if (session->config.speed > 0) {
+            const long long due = session->pace_time
+                + (long long)((session->position - session->pace_position) * 1000 / MOCK_SAMPLE_RATE / session->config.speed);
+
+            if (now_ms() < due) {
+                wait_until(session, due);
+                continue;
+            }
+        }
+
+        count = session->frames - session->position < session->config.chunk_frames
+            ? session->frames - session->position : session->config.chunk_frames;
+        fill_frames(frames, session->track, session->position, count);
+        generation = session->generation;
+        session->delivering = 1;
+
+        pthread_mutex_unlock(&session->lock);
+        consumed = session->callbacks.music_delivery
+            ? session->callbacks.music_delivery(session, &format, frames, count) : count;
+        pthread_mutex_lock(&session->lock);
+
+        session->delivering = 0;
+        pthread_cond_broadcast(&session->delivered_cond);
+
+        if (generation != session->generation) {
+            continue;
+        }
+
+        if (!consumed) {
+            wait_until(session, now_ms() + MOCK_BACKOFF_MS);
+            reset_pace(session);
+            continue;
+        }
+
+        session->position += consumed;
+
+        if (session->position >= session->frames && !session->end_sent) {
+            session->end_sent = 1;
+            session->end_pending = 1;
+
+            pthread_mutex_unlock(&session->lock);
+            notify_main_thread(session);
+            pthread_mutex_lock(&session->lock);
+        }
+    }
+
+    return NULL;
+}
+
+static int build_library(sp_session* session)
+{
+    sp_playlistcontainer* container = &session->container;
+    int i, j;
+
+    if (!(container->playlists = calloc(session->config.playlists, sizeof(sp_playlist)))) {
+        return -1;
+    }
+
+    container->num_playlists = session->config.playlists;
+
+    for (i = 0; i < container->num_playlists; i++) {
+        sp_playlist* playlist = &container->playlists[i];
+
+        snprintf(playlist->name, sizeof(playlist->name), "Playlist %d", i);
+
+        if (!(playlist->tracks = calloc(session->config.tracks, sizeof(sp_track)))) {
+            return -1;
+        }
+
+        playlist->num_tracks = session->config.tracks;
+        playlist->loaded = !session->unload_playlists;
+
+        for (j = 0; j < playlist->num_tracks; j++) {
+            sp_track* track = &playlist->tracks[j];
+
+            track->id = i * session->config.tracks + j;
+            track->duration = session->config.track_ms;
+            snprintf(track->name, sizeof(track->name), "Track %d", j);
+        }
+    }
+
+    return 0;
+}
+
+const char* sp_error_message(sp_error error)
+{
+    switch (error) {
+    case SP_ERROR_OK:
+        return "No error";
+    case SP_ERROR_INDEX_OUT_OF_RANGE:
+        return "Index out of range";
+    case SP_ERROR_TRACK_NOT_PLAYABLE:
+        return "Track not playable";
+    case SP_ERROR_IS_LOADING:
+        return "Resource not loaded yet";
+    case SP_ERROR_OTHER_PERMANENT:
+        return "Other permanent error";
+    default:
+        return "Mock error";
+    }
+}
+
+sp_error sp_session_create(const sp_session_config* config, sp_session** sess)
+{
+    sp_session* session = calloc(1, sizeof(sp_session));
+    pthread_condattr_t attr;
+
+    if (!session) {
+        return SP_ERROR_OTHER_PERMANENT;
+    }
+
+    if (config->callbacks) {
+        session->callbacks = *config->callbacks;
+    }
+
+    session->userdata = config->userdata;
+    session->unload_playlists = config->initially_unload_playlists;
+    session->state = SP_CONNECTION_STATE_LOGGED_OUT;
+    read_config(&session->config);
+
+    if (build_library(session) < 0) {
+        return SP_ERROR_OTHER_PERMANENT;
+    }
+
+    pthread_mutex_init(&session->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&session->player_cond, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_cond_init(&session->delivered_cond, NULL);
+
+    if (pthread_create(&session->delivery, NULL, delivery_thread, session)) {
+        return SP_ERROR_OTHER_PERMANENT;
+    }
+
+    *sess = session;
+    return SP_ERROR_OK;
+}
+
+sp_error sp_session_login(sp_session* session, const char* username, const char* password, bool remember_me, const char* blob)
+{
+    pthread_mutex_lock(&session->lock);
+    session->login_time = now_ms() + session->config.login_ms;
+    pthread_mutex_unlock(&session->lock);
+
+    notify_main_thread(session);
+    return SP_ERROR_OK;
+}
+
+sp_error sp_session_logout(sp_session* session)
+{
+    pthread_mutex_lock(&session->lock);
+    session->state = SP_CONNECTION_STATE_LOGGED_OUT;
+    pthread_mutex_unlock(&session->lock);
+
+    return SP_ERROR_OK;
+}
+
+sp_error sp_session_release(sp_session* session)
+{
+    /* delivery thread is never stopped, the session lives until exit */
+    return SP_ERROR_OK;
+}
+
+sp_connectionstate sp_session_connectionstate(sp_session* session)
+{
+    return session->state;
+}
+
+void* sp_session_userdata(sp_session* session)
+{
+    return session->userdata;
+}
+
+sp_playlistcontainer* sp_session_playlistcontainer(sp_session* session)
+{
+    return &session->container;
+}
+
+/* earliest of the pending event times, updated with time */
+static void next_event(long long* next, long long time)
+{
+    if (time && (!*next || time < *next)) {
+        *next = time;
+    }
+}
+
+sp_error sp_session_process_events(sp_session* session, int* next_timeout)
+{
+    sp_playlistcontainer* container = &session->container;
+    long long now = now_ms(), next = 0;
+    struct mock_callbacks callbacks;
+    int i, j;
+
+    pthread_mutex_lock(&session->lock);
+
+    if (session->login_time && session->login_time <= now) {
+        session->login_time = 0;
+        session->state = SP_CONNECTION_STATE_LOGGED_IN;
+        container->load_time = now + session->config.container_ms;
+
+        pthread_mutex_unlock(&session->lock);
+
+        if (session->callbacks.logged_in) {
+            session->callbacks.logged_in(session, SP_ERROR_OK);
+        }
+
+        if (session->callbacks.connectionstate_updated) {
+            session->callbacks.connectionstate_updated(session);
+        }
+
+        pthread_mutex_lock(&session->lock);
+    }
+
+    if (container->load_time && container->load_time <= now) {
+        container->load_time = 0;
+        container->loaded = 1;
+        callbacks = container->callbacks;
+
+        pthread_mutex_unlock(&session->lock);
+
+        for (j = 0; j < callbacks.count; j++) {
+            sp_playlistcontainer_callbacks* pc_callbacks = callbacks.callbacks[j];
+
+            if (pc_callbacks->container_loaded) {
+                pc_callbacks->container_loaded(container, callbacks.userdata[j]);
+            }
+        }
+
+        pthread_mutex_lock(&session->lock);
+    }
+
+    for (i = 0; i < container->num_playlists; i++) {
+        sp_playlist* playlist = &container->playlists[i];
+
+        if (!playlist->load_time || playlist->load_time > now) {
+            continue;
+        }
+
+        playlist->load_time = 0;
+        playlist->loaded = 1;
+        callbacks = playlist->callbacks;
+
+        pthread_mutex_unlock(&session->lock);
+
+        for (j = 0; j < callbacks.count; j++) {
+            sp_playlist_callbacks* pl_callbacks = callbacks.callbacks[j];
+
+            if (pl_callbacks->playlist_state_changed) {
+                pl_callbacks->playlist_state_changed(playlist, callbacks.userdata[j]);
+            }
+        }
+
+        pthread_mutex_lock(&session->lock);
+    }
+
+    if (session->end_pending) {
+        session->end_pending = 0;
+
+        pthread_mutex_unlock(&session->lock);
+
+        if (session->callbacks.end_of_track) {
+            session->callbacks.end_of_track(session);
+        }
+
+        pthread_mutex_lock(&session->lock);
+    }
+
+    if (session->metadata_time && session->metadata_time <= now) {
+        session->metadata_track->metadata_loaded = 1;
+        session->metadata_track = NULL;
+        session->metadata_time = 0;
+
+        pthread_mutex_unlock(&session->lock);
+
+        if (session->callbacks.metadata_updated) {
+            session->callbacks.metadata_updated(session);
+        }
+
+        pthread_mutex_lock(&session->lock);
+    }
+
+    next_event(&next, session->login_time);
+    next_event(&next, session->metadata_time);
+    next_event(&next, container->load_time);
+
+    for (i = 0; i < container->num_playlists; i++) {
+        next_event(&next, container->playlists[i].load_time);
+    }
+
+    pthread_mutex_unlock(&session->lock);
+
+    now = now_ms();
+    *next_timeout = !next ? MOCK_IDLE_MS : next > now ? next - now : 0;
+
+    return SP_ERROR_OK;
+}
+
+sp_error sp_session_player_load(sp_session* session, sp_track* track)
+{
+    pthread_mutex_lock(&session->lock);
+
+    /* metadata_updated is called when the load finishes, then loading can be retried */
+    if (session->config.metadata_ms && !track->metadata_loaded) {
+        if (!session->metadata_track) {
+            session->metadata_track = track;
+            session->metadata_time = now_ms() + session->config.metadata_ms;
+        }
+
+        pthread_mutex_unlock(&session->lock);
+        notify_main_thread(session);
+
+        return SP_ERROR_IS_LOADING;
+    }
+
+    wait_for_delivery(session);
+
+    session->track = track;
+    session->frames = (long long)track->duration * MOCK_SAMPLE_RATE / 1000;
+    session->position = 0;
+    session->playing = 0;
+    session->end_sent = 0;
+    session->end_pending = 0;
+    session->generation++;
+
+    pthread_mutex_unlock(&session->lock);
+
+    return SP_ERROR_OK;
+}
+
+sp_error sp_session_player_seek(sp_session* session, int offset)
+{
+    pthread_mutex_lock(&session->lock);
+
+    wait_for_delivery(session);
+
+    if (session->track) {
+        session->position = (long long)offset * MOCK_SAMPLE_RATE / 1000;
+        session->end_sent = 0;
+        session->end_pending = 0;
+        session->generation++;
+        reset_pace(session);
+        pthread_cond_signal(&session->player_cond);
+    }
+
+    pthread_mutex_unlock(&session->lock);
+
+    return SP_ERROR_OK;
+}
+
+sp_error sp_session_player_play(sp_session* session, bool play)
+{
+    pthread_mutex_lock(&session->lock);
+
+    session->playing = play;
+
+    if (play) {
+        reset_pace(session);
+        pthread_cond_signal(&session->player_cond);
+    }
+
+    pthread_mutex_unlock(&session->lock);
+
+    return SP_ERROR_OK;
+}
+
+sp_error sp_session_player_unload(sp_session* session)
+{
+    pthread_mutex_lock(&session->lock);
+    wait_for_delivery(session);
+
+    session->track = NULL;
+    session->playing = 0;
+    session->end_pending = 0;
+    session->generation++;
+
+    pthread_mutex_unlock(&session->lock);
+
+    return SP_ERROR_OK;
+}
+
+sp_error sp_session_player_prefetch(sp_session* session, sp_track* track)
+{
+    return SP_ERROR_OK;
+}
+
+sp_error sp_playlistcontainer_add_callbacks(sp_playlistcontainer* pc, sp_playlistcontainer_callbacks* callbacks, void* userdata)
+{
+    add_callbacks(&pc->callbacks, callbacks, userdata);
+    return SP_ERROR_OK;
+}
+
+bool sp_playlistcontainer_is_loaded(sp_playlistcontainer* pc)
+{
+    return pc->loaded;
+}
+
+int sp_playlistcontainer_num_playlists(sp_playlistcontainer* pc)
+{
+    return pc->loaded ? pc->num_playlists : 0;
+}
+
+sp_playlist* sp_playlistcontainer_playlist(sp_playlistcontainer* pc, int index)
+{
+    return pc->loaded && index >= 0 && index < pc->num_playlists ? &pc->playlists[index] : NULL;
+}
+
+sp_error sp_playlist_add_callbacks(sp_playlist* playlist, sp_playlist_callbacks* callbacks, void* userdata)
+{
+    add_callbacks(&playlist->callbacks, callbacks, userdata);
+    return SP_ERROR_OK;
+}
+
+sp_error sp_playlist_remove_callbacks(sp_playlist* playlist, sp_playlist_callbacks* callbacks, void* userdata)
+{
+    remove_callbacks(&playlist->callbacks, callbacks, userdata);
+    return SP_ERROR_OK;
+}
+
+bool sp_playlist_is_loaded(sp_playlist* playlist)
+{
+    return playlist->loaded;
+}
+
+const char* sp_playlist_name(sp_playlist* playlist)
+{
+    return playlist->name;
+}
+
+int sp_playlist_num_tracks(sp_playlist* playlist)
+{
+    return playlist->loaded ? playlist->num_tracks : 0;
+}
+
+sp_track* sp_playlist_track(sp_playlist* playlist, int index)
+{
+    return playlist->loaded && index >= 0 && index < playlist->num_tracks ? &playlist->tracks[index] : NULL;
+}
+
+sp_error sp_playlist_set_in_ram(sp_session* session, sp_playlist* playlist, bool in_ram)
+{
+    int notify = 0;
+
+    pthread_mutex_lock(&session->lock);
+
+    if (in_ram && !playlist->loaded && !playlist->load_time) {
+        playlist->load_time = now_ms() + session->config.playlist_ms;
+        notify = 1;
+    } else if (!in_ram && session->unload_playlists) {
+        playlist->loaded = 0;
+        playlist->load_time = 0;
+    }
+
+    pthread_mutex_unlock(&session->lock);
+
+    /* state change is reported from process_events */
+    if (notify) {
+        notify_main_thread(session);
+    }
+
+    return SP_ERROR_OK;
+}
+
+const char* sp_track_name(sp_track* track)
+{
+    return track->name;
+}
+
+int sp_track_duration(sp_track* track)
+{
+    return track->duration;
+}
+
+/* tracks live as long as the session, references are not counted */
+sp_error sp_track_add_ref(sp_track* track)
+{
+    return SP_ERROR_OK;
+}
+
+sp_error sp_track_release(sp_track* track)
+{
+    return SP_ERROR_OK;
+}
+
+sp_link* sp_link_create_from_track(sp_track* track, int offset)
+{
+    sp_link* link = malloc(sizeof(sp_link));
+
+    if (link) {
+        snprintf(link->uri, sizeof(link->uri), "spotify:track:mock%08d", track->id);
+    }
+
+    return link;
+}
+
+int sp_link_as_string(sp_link* link, char* buffer, int buffer_size)
+{
+    return snprintf(buffer, buffer_size, "%s", link->uri);
+}
+
+sp_error sp_link_release(sp_link* link)
+{
+    free(link);
+    return SP_ERROR_OK;
+}
@@ -0,0 +1,108 @@
+#include "arena.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define ARENA_ALIGNMENT 16
+
+struct arena_block
+{
+    struct arena_block* next;
+    size_t size;
+    size_t used;
+    char data[] __attribute__((aligned(ARENA_ALIGNMENT)));
+};
+
+void arena_init(struct arena* arena, size_t block_size)
+{
+    arena->blocks = NULL;
+    arena->block_size = block_size;
+    arena->allocated = 0;
+}
+
+void* arena_alloc(struct arena* arena, size_t size)
+{
+    struct arena_block* block = arena->blocks;
+    void* memory;
+
+    size = (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+
+    if (!block || block->size - block->used < size) {
+        /* objects bigger than block size get a block of their own */
+        const size_t block_size = size > arena->block_size ? size : arena->block_size;
+
+        if (!(block = malloc(sizeof(struct arena_block) + block_size))) {
+            return NULL;
+        }
+
+        block->size = block_size;
+        block->used = 0;
+
+        /* keep partially used block in front if the new one is already full */
+        if (arena->blocks && size > arena->block_size) {
+            block->next = arena->blocks->next;
+            arena->blocks->next = block;
+        } else {
+            block->next = arena->blocks;
+            arena->blocks = block;
+        }
+
+        arena->allocated += block_size;
+    }
+
+    memory = block->data + block->used;
+    block->used += size;
+
+    return memory;
+}
+
+char* arena_strdup(struct arena* arena, const char* string)
+{
+    const size_t size = strlen(string) + 1;
+    char* copy = arena_alloc(arena, size);
+
+    if (copy) {
+        memcpy(copy, string, size);
+    }
+
+    return copy;
+}
+
+void arena_move(struct arena* to, struct arena* from)
+{
+    struct arena_block* last = from->blocks;
+
+    if (!last) {
+        return;
+    }
+
+    while (last->next) {
+        last = last->next;
+    }
+
+    /* new blocks are put after to's current block, so it is still filled first */
+    if (to->blocks) {
+        last->next = to->blocks->next;
+        to->blocks->next = from->blocks;
+    } else {
+        to->blocks = from->blocks;
+    }
+
+    to->allocated += from->allocated;
+
+    from->blocks = NULL;
+    from->allocated = 0;
+}
+
+void arena_release(struct arena* arena)
+{
+    struct arena_block* block = arena->blocks;
+
+    while (block) {
+        struct arena_block* next = block->next;
+        free(block);
+        block = next;
+    }
+
+    arena->blocks = NULL;
+    arena->allocated = 0;
+}
@@ -0,0 +1,30 @@
+#ifndef SPOTIFS_ARENA_H
+#define SPOTIFS_ARENA_H
+
+#include <stddef.h>
+
+/*
+ * bump allocator for objects sharing a lifetime (eg. all entries of one
+ * playlist). There is no per object free, the whole arena is released
+ * at once.
+ */
+
+struct arena_block;
+
+struct arena
+{
+    struct arena_block* blocks;
+    size_t block_size;
+    size_t allocated;
+};
+
+#define ARENA_INITIALIZER(size) { NULL, size, 0 }
+
+void arena_init(struct arena* arena, size_t block_size);
+void* arena_alloc(struct arena* arena, size_t size);
+char* arena_strdup(struct arena* arena, const char* string);
+/* hand all memory of from over to arena to, from is left empty */
+void arena_move(struct arena* to, struct arena* from);
+void arena_release(struct arena* arena);
+
+#endif // SPOTIFS_ARENA_H
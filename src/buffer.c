@@ -0,0 +1,279 @@
+#include "buffer.h"
+#include <stdlib.h>
+#include <string.h>
+
+int buffer_init(struct stream_buffer* buffer, size_t capacity)
+{
+    memset(buffer, 0, sizeof(struct stream_buffer));
+
+    buffer->num_segments = (capacity + BUFFER_SEGMENT_SIZE - 1) / BUFFER_SEGMENT_SIZE;
+    buffer->segments = calloc(buffer->num_segments ? buffer->num_segments : 1, sizeof(char*));
+
+    if (!buffer->segments) {
+        return -1;
+    }
+
+    buffer->capacity = capacity;
+    return 0;
+}
+
+void buffer_release(struct stream_buffer* buffer)
+{
+    size_t i;
+
+    if (buffer->segments) {
+        for (i = 0; i < buffer->num_segments; i++) {
+            free(buffer->segments[i]);
+        }
+    }
+
+    free(buffer->segments);
+    free(buffer->extents);
+    memset(buffer, 0, sizeof(struct stream_buffer));
+}
+
+int buffer_is_initialized(const struct stream_buffer* buffer)
+{
+    return buffer->segments != NULL;
+}
+
+static int add_extent(struct stream_buffer* buffer, off_t start, off_t end)
+{
+    struct buffer_extent* extents = buffer->extents;
+    size_t first = 0, last;
+
+    /* skip extents which end before the new one (not even touching it) */
+    while (first < buffer->num_extents && extents[first].end < start) {
+        first++;
+    }
+
+    /* all extents overlapping or touching [start, end) are merged */
+    last = first;
+
+    while (last < buffer->num_extents && extents[last].start <= end) {
+        if (extents[last].start < start) start = extents[last].start;
+        if (extents[last].end > end) end = extents[last].end;
+        last++;
+    }
+
+    if (first == last) {
+        /* nothing to merge, insert new extent at first */
+        if (buffer->num_extents == buffer->extents_capacity) {
+            size_t capacity = buffer->extents_capacity ? buffer->extents_capacity * 2 : 8;
+            extents = realloc(buffer->extents, capacity * sizeof(struct buffer_extent));
+
+            if (!extents) {
+                return -1;
+            }
+
+            buffer->extents = extents;
+            buffer->extents_capacity = capacity;
+        }
+
+        memmove(extents + first + 1, extents + first, (buffer->num_extents - first) * sizeof(struct buffer_extent));
+        buffer->num_extents++;
+    } else {
+        /* collapse [first, last) into single extent */
+        memmove(extents + first + 1, extents + last, (buffer->num_extents - last) * sizeof(struct buffer_extent));
+        buffer->num_extents -= last - first - 1;
+    }
+
+    extents[first].start = start;
+    extents[first].end = end;
+
+    return 0;
+}
+
+static size_t copy_to_segments(struct stream_buffer* buffer, off_t offset, const void* data, size_t size)
+{
+    size_t stored = 0;
+
+    while (stored < size) {
+        const size_t index = offset / BUFFER_SEGMENT_SIZE;
+        const size_t segment_offset = offset % BUFFER_SEGMENT_SIZE;
+        size_t chunk = BUFFER_SEGMENT_SIZE - segment_offset;
+
+        if (chunk > size - stored) {
+            chunk = size - stored;
+        }
+
+        if (!buffer->segments[index]) {
+            buffer->segments[index] = malloc(BUFFER_SEGMENT_SIZE);
+
+            if (!buffer->segments[index]) {
+                break;
+            }
+        }
+
+        if (data) {
+            memcpy(buffer->segments[index] + segment_offset, (const char*)data + stored, chunk);
+        } else {
+            memset(buffer->segments[index] + segment_offset, 0, chunk);
+        }
+
+        stored += chunk;
+        offset += chunk;
+    }
+
+    return stored;
+}
+
+/* number of extents starting at or before offset, the last of them can contain it */
+static size_t extents_before(const struct stream_buffer* buffer, off_t offset)
+{
+    size_t low = 0, high = buffer->num_extents;
+
+    while (low < high) {
+        const size_t mid = (low + high) / 2;
+
+        if (buffer->extents[mid].start <= offset) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    return low;
+}
+
+size_t buffer_write(struct stream_buffer* buffer, const void* data, size_t size)
+{
+    size_t written = 0;
+
+    if (buffer->write_pointer >= buffer->capacity) {
+        return 0;
+    }
+
+    if (size > buffer->capacity - buffer->write_pointer) {
+        size = buffer->capacity - buffer->write_pointer;
+    }
+
+    /* present bytes can be copied by readers without locking, only gaps are written */
+    while (written < size) {
+        const off_t offset = buffer->write_pointer;
+        const size_t i = extents_before(buffer, offset);
+        size_t chunk = size - written, stored;
+
+        if (i && buffer->extents[i - 1].end > offset) {
+            if (chunk > buffer->extents[i - 1].end - offset) {
+                chunk = buffer->extents[i - 1].end - offset;
+            }
+
+            buffer->write_pointer += chunk;
+            written += chunk;
+            continue;
+        }
+
+        if (i < buffer->num_extents && chunk > buffer->extents[i].start - offset) {
+            chunk = buffer->extents[i].start - offset;
+        }
+
+        stored = copy_to_segments(buffer, offset, data ? (const char*)data + written : NULL, chunk);
+
+        if (!stored || add_extent(buffer, offset, offset + stored) < 0) {
+            break;
+        }
+
+        buffer->write_pointer += stored;
+        written += stored;
+
+        if (stored < chunk) {
+            break;
+        }
+    }
+
+    return written;
+}
+
+void buffer_fill_tail(struct stream_buffer* buffer)
+{
+    /* zero only gaps, data delivered before a seek is kept */
+    buffer_write(buffer, NULL, buffer->capacity - buffer->write_pointer);
+}
+
+void buffer_seek(struct stream_buffer* buffer, off_t offset)
+{
+    buffer->write_pointer = offset < buffer->capacity ? offset : buffer->capacity;
+}
+
+/* extent containing offset or NULL */
+static const struct buffer_extent* find_extent(const struct stream_buffer* buffer, off_t offset)
+{
+    const size_t low = extents_before(buffer, offset);
+
+    if (low && buffer->extents[low - 1].end > offset) {
+        return &buffer->extents[low - 1];
+    } else {
+        return NULL;
+    }
+}
+
+size_t buffer_available(const struct stream_buffer* buffer, off_t offset)
+{
+    const struct buffer_extent* extent = find_extent(buffer, offset);
+
+    return extent ? extent->end - offset : 0;
+}
+
+int buffer_extent_at(const struct stream_buffer* buffer, off_t offset, struct buffer_extent* out)
+{
+    const struct buffer_extent* extent = find_extent(buffer, offset);
+
+    if (!extent) {
+        return -1;
+    }
+
+    *out = *extent;
+    return 0;
+}
+
+int buffer_has(const struct stream_buffer* buffer, off_t offset, size_t size)
+{
+    return buffer_available(buffer, offset) >= size;
+}
+
+size_t buffer_copy(const struct stream_buffer* buffer, off_t offset, size_t size, char* out)
+{
+    size_t copied = 0;
+
+    while (copied < size) {
+        const size_t index = offset / BUFFER_SEGMENT_SIZE;
+        const size_t segment_offset = offset % BUFFER_SEGMENT_SIZE;
+        size_t chunk = BUFFER_SEGMENT_SIZE - segment_offset;
+
+        if (chunk > size - copied) {
+            chunk = size - copied;
+        }
+
+        memcpy(out + copied, buffer->segments[index] + segment_offset, chunk);
+
+        copied += chunk;
+        offset += chunk;
+    }
+
+    return copied;
+}
+
+size_t buffer_filled(const struct stream_buffer* buffer)
+{
+    size_t filled = 0, i;
+
+    for (i = 0; i < buffer->num_extents; i++) {
+        filled += buffer->extents[i].end - buffer->extents[i].start;
+    }
+
+    return filled;
+}
+
+size_t buffer_resident(const struct stream_buffer* buffer)
+{
+    size_t resident = 0, i;
+
+    for (i = 0; i < buffer->num_segments; i++) {
+        if (buffer->segments[i]) {
+            resident += BUFFER_SEGMENT_SIZE;
+        }
+    }
+
+    return resident;
+}
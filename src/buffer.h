@@ -0,0 +1,64 @@
+#ifndef SPOTIFS_BUFFER_H
+#define SPOTIFS_BUFFER_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#define BUFFER_SEGMENT_SIZE (256 * 1024)
+
+/* range of bytes [start, end) present in the buffer */
+struct buffer_extent
+{
+    off_t start;
+    off_t end;
+};
+
+/*
+ * sparse buffer for PCM data of a track. Memory is split into fixed size
+ * segments allocated on first write, list of extents (sorted, never
+ * overlapping nor touching) describes which bytes were written.
+ */
+struct stream_buffer
+{
+    char** segments;
+    size_t num_segments;
+    size_t capacity;
+
+    /* position where next delivered data will be stored */
+    off_t write_pointer;
+
+    struct buffer_extent* extents;
+    size_t num_extents;
+    size_t extents_capacity;
+};
+
+int buffer_init(struct stream_buffer* buffer, size_t capacity);
+void buffer_release(struct stream_buffer* buffer);
+int buffer_is_initialized(const struct stream_buffer* buffer);
+
+/*
+ * write data at write pointer and advance it, returns number of bytes stored.
+ * Bytes already present are kept and only skipped over.
+ */
+size_t buffer_write(struct stream_buffer* buffer, const void* data, size_t size);
+/* zero remaining part of buffer starting at write pointer */
+void buffer_fill_tail(struct stream_buffer* buffer);
+void buffer_seek(struct stream_buffer* buffer, off_t offset);
+
+/* number of contiguous bytes present starting at offset */
+size_t buffer_available(const struct stream_buffer* buffer, off_t offset);
+/* extent containing offset, returns -1 if offset is not present */
+int buffer_extent_at(const struct stream_buffer* buffer, off_t offset, struct buffer_extent* out);
+int buffer_has(const struct stream_buffer* buffer, off_t offset, size_t size);
+/*
+ * copy range known to be present without looking at extents. Present data
+ * never changes, so this is safe without locking once presence was checked.
+ */
+size_t buffer_copy(const struct stream_buffer* buffer, off_t offset, size_t size, char* out);
+
+/* number of bytes present in the buffer */
+size_t buffer_filled(const struct stream_buffer* buffer);
+/* bytes of memory allocated for segments */
+size_t buffer_resident(const struct stream_buffer* buffer);
+
+#endif // SPOTIFS_BUFFER_H
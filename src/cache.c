@@ -0,0 +1,518 @@
+#include "cache.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <glib.h>
+
+#define CACHE_VERSION 1
+
+struct cache_header
+{
+    char magic[4];
+    int32_t version;
+    int32_t channels;
+    int32_t sample_rate;
+    int64_t capacity;
+    int64_t num_extents;
+} __attribute__((packed));
+
+struct cache_item
+{
+    char key[NAME_MAX + 1];
+    time_t used;
+    off_t size;
+    /* list of tracks from the least recently used one */
+    struct cache_item* prev;
+    struct cache_item* next;
+};
+
+static char* g_directory = NULL;
+static size_t g_max_size = 0;
+
+/* serializes stores and eviction */
+static pthread_mutex_t g_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* cached tracks by key and in order of use with their total size, read from
+ * the directory once at startup. Guarded by g_items_lock. */
+static GHashTable* g_items = NULL;
+static struct cache_item* g_oldest = NULL;
+static struct cache_item* g_newest = NULL;
+static off_t g_total_size = 0;
+static pthread_mutex_t g_items_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void evict();
+
+static void cache_path(char* path, const char* key, const char* extension)
+{
+    snprintf(path, PATH_MAX, "%s/%s.%s", g_directory, key, extension);
+}
+
+static void unlink_item(struct cache_item* item)
+{
+    *(item->prev ? &item->prev->next : &g_oldest) = item->next;
+    *(item->next ? &item->next->prev : &g_newest) = item->prev;
+    item->prev = item->next = NULL;
+}
+
+static void append_item(struct cache_item* item)
+{
+    item->prev = g_newest;
+    item->next = NULL;
+    *(g_newest ? &g_newest->next : &g_oldest) = item;
+    g_newest = item;
+}
+
+/* item of the track moved to the most recently used end, added if create is set */
+static struct cache_item* use_item(const char* key, int create)
+{
+    struct cache_item* item;
+
+    if ((item = g_hash_table_lookup(g_items, key))) {
+        unlink_item(item);
+    } else if (create && (item = calloc(1, sizeof(struct cache_item)))) {
+        snprintf(item->key, sizeof(item->key), "%s", key);
+        g_hash_table_insert(g_items, item->key, item);
+    } else {
+        return NULL;
+    }
+
+    append_item(item);
+
+    return item;
+}
+
+static void remove_item(struct cache_item* item)
+{
+    g_total_size -= item->size;
+    unlink_item(item);
+    g_hash_table_remove(g_items, item->key);
+}
+
+/* disk space taken by files of the track, -1 if it has no index */
+static off_t stored_size(const char* key, time_t* used)
+{
+    struct stat idx, pcm;
+    char path[PATH_MAX];
+
+    cache_path(path, key, "idx");
+
+    if (stat(path, &idx) < 0) {
+        return -1;
+    }
+
+    cache_path(path, key, "pcm");
+
+    if (stat(path, &pcm) < 0) {
+        pcm.st_blocks = 0;
+    }
+
+    if (used) {
+        *used = idx.st_mtime;
+    }
+
+    /* pcm files are sparse, count only allocated blocks */
+    return idx.st_blocks * 512 + pcm.st_blocks * 512;
+}
+
+static int compare_items(const void* a, const void* b)
+{
+    const struct cache_item* first = *(struct cache_item* const*)a;
+    const struct cache_item* second = *(struct cache_item* const*)b;
+
+    return (first->used > second->used) - (first->used < second->used);
+}
+
+static int has_suffix(const char* name, size_t length, const char* suffix)
+{
+    const size_t suffix_length = strlen(suffix);
+
+    return length > suffix_length && !strcmp(name + length - suffix_length, suffix);
+}
+
+/* list of cached tracks ordered by index modification time, files of interrupted stores are removed */
+static void scan_directory()
+{
+    struct cache_item** items = NULL;
+    size_t num_items = 0, capacity = 0, i;
+    struct dirent* dirent;
+    char path[PATH_MAX];
+    DIR* dir;
+
+    if (!(dir = opendir(g_directory))) {
+        return;
+    }
+
+    while ((dirent = readdir(dir))) {
+        const size_t length = strlen(dirent->d_name);
+        struct cache_item* item;
+        char key[NAME_MAX + 1];
+
+        if (has_suffix(dirent->d_name, length, ".tmp")) {
+            snprintf(path, PATH_MAX, "%s/%s", g_directory, dirent->d_name);
+            unlink(path);
+            continue;
+        }
+
+        if (has_suffix(dirent->d_name, length, ".pcm")) {
+            memcpy(key, dirent->d_name, length - 4);
+            key[length - 4] = 0;
+            cache_path(path, key, "idx");
+
+            /* data whose index was removed before it was replaced */
+            if (access(path, F_OK) < 0) {
+                cache_path(path, key, "pcm");
+                unlink(path);
+            }
+
+            continue;
+        }
+
+        if (!has_suffix(dirent->d_name, length, ".idx")) {
+            continue;
+        }
+
+        if (num_items == capacity) {
+            struct cache_item** grown;
+
+            capacity = capacity ? capacity * 2 : 64;
+
+            if (!(grown = realloc(items, capacity * sizeof(struct cache_item*)))) {
+                break;
+            }
+
+            items = grown;
+        }
+
+        if (!(item = calloc(1, sizeof(struct cache_item)))) {
+            break;
+        }
+
+        memcpy(item->key, dirent->d_name, length - 4);
+        item->key[length - 4] = 0;
+
+        if ((item->size = stored_size(item->key, &item->used)) < 0) {
+            free(item);
+            continue;
+        }
+
+        items[num_items++] = item;
+    }
+
+    closedir(dir);
+
+    qsort(items, num_items, sizeof(struct cache_item*), compare_items);
+
+    for (i = 0; i < num_items; i++) {
+        g_hash_table_insert(g_items, items[i]->key, items[i]);
+        append_item(items[i]);
+        g_total_size += items[i]->size;
+    }
+
+    free(items);
+}
+
+int cache_init(const char* directory, size_t max_size)
+{
+    if (mkdir(directory, 0700) < 0 && errno != EEXIST) {
+        g_warning("%s: can't create cache directory '%s': %s", __func__, directory, strerror(errno));
+        return -1;
+    }
+
+    g_directory = strdup(directory);
+    g_max_size = max_size;
+    g_items = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, free);
+
+    pthread_mutex_lock(&g_cache_lock);
+    pthread_mutex_lock(&g_items_lock);
+    scan_directory();
+    pthread_mutex_unlock(&g_items_lock);
+
+    g_info("%s: %u tracks, %lld bytes", __func__, g_hash_table_size(g_items), (long long)g_total_size);
+
+    evict();
+    pthread_mutex_unlock(&g_cache_lock);
+
+    return 0;
+}
+
+int cache_enabled()
+{
+    return g_directory != NULL;
+}
+
+/* read index of cached track, extents are allocated and must be freed by caller */
+static int read_index(const char* key, struct cache_info* info, struct buffer_extent** extents, size_t* num_extents)
+{
+    struct cache_header header;
+    char path[PATH_MAX];
+    size_t bytes;
+    int fd;
+
+    cache_path(path, key, "idx");
+
+    if ((fd = open(path, O_RDONLY)) < 0) {
+        return -1;
+    }
+
+    if (read(fd, &header, sizeof(header)) != sizeof(header)
+        || memcmp(header.magic, "SFSC", 4) || header.version != CACHE_VERSION
+        || header.num_extents <= 0) {
+        close(fd);
+        return -1;
+    }
+
+    bytes = header.num_extents * sizeof(struct buffer_extent);
+    *extents = malloc(bytes);
+
+    if (!*extents || read(fd, *extents, bytes) != bytes) {
+        free(*extents);
+        close(fd);
+        return -1;
+    }
+
+    close(fd);
+
+    info->channels = header.channels;
+    info->sample_rate = header.sample_rate;
+    info->capacity = header.capacity;
+    info->complete = header.num_extents == 1 && (*extents)[0].start == 0 && (*extents)[0].end == header.capacity;
+    *num_extents = header.num_extents;
+
+    /* mark as recently used, modification time orders tracks after restart */
+    utimes(path, NULL);
+
+    pthread_mutex_lock(&g_items_lock);
+    use_item(key, 0);
+    pthread_mutex_unlock(&g_items_lock);
+
+    return 0;
+}
+
+int cache_open_complete(const char* key, struct cache_info* info)
+{
+    struct buffer_extent* extents;
+    size_t num_extents;
+    char path[PATH_MAX];
+
+    if (!cache_enabled() || read_index(key, info, &extents, &num_extents) < 0) {
+        return -1;
+    }
+
+    free(extents);
+
+    if (!info->complete) {
+        return -1;
+    }
+
+    cache_path(path, key, "pcm");
+    return open(path, O_RDONLY);
+}
+
+int cache_load(const char* key, struct cache_info* info, struct stream_buffer* buffer)
+{
+    struct buffer_extent* extents;
+    size_t num_extents, i;
+    char path[PATH_MAX];
+    char* chunk;
+    int fd;
+
+    if (!cache_enabled() || read_index(key, info, &extents, &num_extents) < 0) {
+        return -1;
+    }
+
+    cache_path(path, key, "pcm");
+
+    if ((fd = open(path, O_RDONLY)) < 0 || buffer_init(buffer, info->capacity) < 0) {
+        if (fd >= 0) close(fd);
+        free(extents);
+        return -1;
+    }
+
+    chunk = malloc(BUFFER_SEGMENT_SIZE);
+
+    for (i = 0; chunk && i < num_extents; i++) {
+        off_t offset = extents[i].start;
+
+        buffer_seek(buffer, offset);
+
+        while (offset < extents[i].end) {
+            size_t size = extents[i].end - offset;
+            ssize_t bytes;
+
+            if (size > BUFFER_SEGMENT_SIZE) {
+                size = BUFFER_SEGMENT_SIZE;
+            }
+
+            if ((bytes = pread(fd, chunk, size, offset)) <= 0) {
+                break;
+            }
+
+            buffer_write(buffer, chunk, bytes);
+            offset += bytes;
+        }
+    }
+
+    free(chunk);
+    free(extents);
+    close(fd);
+
+    g_debug("%s: %s: %zu of %zu bytes", __func__, key, buffer_filled(buffer), buffer->capacity);
+
+    return 0;
+}
+
+/* remove least recently used tracks until cache fits in configured size, g_cache_lock is held */
+static void evict()
+{
+    struct cache_item* item;
+    char path[PATH_MAX];
+
+    pthread_mutex_lock(&g_items_lock);
+
+    while ((item = g_oldest) && g_total_size > g_max_size) {
+        g_debug("%s: removing %s", __func__, item->key);
+
+        cache_path(path, item->key, "idx");
+        unlink(path);
+        cache_path(path, item->key, "pcm");
+        unlink(path);
+
+        remove_item(item);
+    }
+
+    pthread_mutex_unlock(&g_items_lock);
+}
+
+static int write_data(int fd, const struct stream_buffer* buffer)
+{
+    size_t i;
+
+    for (i = 0; i < buffer->num_extents; i++) {
+        off_t offset = buffer->extents[i].start;
+
+        while (offset < buffer->extents[i].end) {
+            const size_t segment_offset = offset % BUFFER_SEGMENT_SIZE;
+            size_t size = BUFFER_SEGMENT_SIZE - segment_offset;
+
+            if (size > buffer->extents[i].end - offset) {
+                size = buffer->extents[i].end - offset;
+            }
+
+            if (pwrite(fd, buffer->segments[offset / BUFFER_SEGMENT_SIZE] + segment_offset, size, offset) != size) {
+                return -1;
+            }
+
+            offset += size;
+        }
+    }
+
+    return 0;
+}
+
+int cache_store(const char* key, const struct cache_info* info, const struct stream_buffer* buffer)
+{
+    struct cache_header header = {
+        .magic = {'S', 'F', 'S', 'C'},
+        .version = CACHE_VERSION,
+        .channels = info->channels,
+        .sample_rate = info->sample_rate,
+        .capacity = buffer->capacity,
+        .num_extents = buffer->num_extents
+    };
+    char path[PATH_MAX], temporary[PATH_MAX];
+    const size_t extents_size = buffer->num_extents * sizeof(struct buffer_extent);
+    struct cache_item* item;
+    int fd, ret = 0;
+    off_t size;
+
+    if (!cache_enabled() || !buffer->num_extents) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&g_cache_lock);
+
+    /* files are replaced by renames, so open cached tracks keep reading the
+     * old data. Index goes first, data is never described by another one. */
+    cache_path(path, key, "idx");
+    unlink(path);
+
+    cache_path(temporary, key, "pcm.tmp");
+    cache_path(path, key, "pcm");
+
+    if ((fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0 || write_data(fd, buffer) < 0) {
+        g_warning("%s: can't write '%s': %s", __func__, temporary, strerror(errno));
+        ret = -1;
+    }
+
+    if (fd >= 0) close(fd);
+
+    if (!ret && rename(temporary, path) < 0) {
+        ret = -1;
+    }
+
+    if (ret) {
+        unlink(temporary);
+    }
+
+    cache_path(temporary, key, "tmp");
+    cache_path(path, key, "idx");
+
+    if (!ret) {
+        if ((fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0
+            || write(fd, &header, sizeof(header)) != sizeof(header)
+            || write(fd, buffer->extents, extents_size) != extents_size) {
+            g_warning("%s: can't write '%s': %s", __func__, temporary, strerror(errno));
+            ret = -1;
+        }
+
+        if (fd >= 0) close(fd);
+
+        if (!ret && rename(temporary, path) < 0) {
+            ret = -1;
+        }
+
+        if (ret) {
+            unlink(temporary);
+        }
+    }
+
+    pthread_mutex_lock(&g_items_lock);
+
+    if (!ret && ((size = stored_size(key, NULL)) < 0 || !(item = use_item(key, 1)))) {
+        ret = -1;
+    }
+
+    if (!ret) {
+        g_total_size += size - item->size;
+        item->size = size;
+    } else if ((item = g_hash_table_lookup(g_items, key))) {
+        /* whatever is left of the track isn't indexed anymore */
+        remove_item(item);
+    }
+
+    pthread_mutex_unlock(&g_items_lock);
+
+    if (ret) {
+        cache_path(path, key, "idx");
+        unlink(path);
+        cache_path(path, key, "pcm");
+        unlink(path);
+    }
+
+    evict();
+
+    pthread_mutex_unlock(&g_cache_lock);
+
+    g_debug("%s: %s: %zu of %zu bytes, result: %d", __func__, key, buffer_filled(buffer), buffer->capacity, ret);
+
+    return ret;
+}
@@ -0,0 +1,33 @@
+#ifndef SPOTIFS_CACHE_H
+#define SPOTIFS_CACHE_H
+
+#include <stddef.h>
+#include "buffer.h"
+
+/*
+ * on-disk cache of decoded PCM data. Every track is stored in two files
+ * named after its key: <key>.pcm holding data at the same offsets as in
+ * stream_buffer (possibly sparse) and <key>.idx with format and list of
+ * present extents. Least recently used tracks are removed when cache
+ * grows over the configured size, which is tracked in memory after
+ * cache_init scans the directory.
+ */
+
+struct cache_info
+{
+    int channels;
+    int sample_rate;
+    size_t capacity;
+    int complete;
+};
+
+int cache_init(const char* directory, size_t max_size);
+int cache_enabled();
+
+/* open PCM file of completely cached track, returns -1 if track is missing or incomplete */
+int cache_open_complete(const char* key, struct cache_info* info);
+/* initialize buffer with cached part of track, returns -1 if nothing is cached */
+int cache_load(const char* key, struct cache_info* info, struct stream_buffer* buffer);
+int cache_store(const char* key, const struct cache_info* info, const struct stream_buffer* buffer);
+
+#endif // SPOTIFS_CACHE_H
@@ -1,129 +1,812 @@
 #include <string.h>
 #include <stdlib.h>
-#include <libgen.h>
+#include <limits.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <glib.h>
 #include "spotify.h"
 #include "context.h"
 #include "logger.h"
 #include "fs.h"
 #include "sfs.h"
+#include "inode.h"
+#include "trace.h"
+#include "stats.h"
 
-#define get_app_context fuse_get_context()->private_data;
+#define get_app_context(req) ((struct spotifs_context*)fuse_req_userdata(req))
 
-static int fuse_getattr(const char *path, struct stat *stbuf)
+/* d_ino of listed entries the kernel didn't look up, as the high-level API uses */
+#ifndef FUSE_UNKNOWN_INO
+#define FUSE_UNKNOWN_INO 0xffffffff
+#endif
+
+static struct fs_options g_options;
+
+static void fill_stat(struct sfs_entry* entry, fuse_ino_t ino, struct stat* stbuf)
 {
     memset(stbuf, 0, sizeof(struct stat));
 
-    struct sfs_entry* entry = sfs_get(spotify_get_root(), path);
+    stbuf->st_ino = ino;
+
+    if (entry->type & sfs_directory) {
+        stbuf->st_mode = S_IFDIR | 0555;
+        stbuf->st_nlink = 2;
+    } else {
+        /* tracks and generated files */
+        stbuf->st_mode = S_IFREG | 0444;
+        stbuf->st_nlink = 1;
+    }
+
+    stbuf->st_size = entry->size;
+}
+
+/* operation was replied, result is 0, number of bytes or negative errno */
+static void finish_op(int op, fuse_ino_t ino, const char* name, off_t offset, size_t size, int result,
+    const struct trace_start* start)
+{
+    stats_op(op, result, stats_clock() - start->time);
+    trace_op(op, ino, name, offset, size, result, start);
+}
+
+/*
+ * entry of inode, playlists are materialized when listed as in
+ * spotify_lookup. Directory lock is held on return (also when NULL is
+ * returned).
+ */
+static struct sfs_entry* get_entry(struct spotifs_context* ctx, fuse_ino_t ino, int flags)
+{
+    struct sfs_entry* entry;
+    char path[PATH_MAX];
+
+    spotify_lock_directory(flags & SPOTIFY_LOOKUP_WRITE);
+
+    entry = inode_entry(ino);
+
+    if (entry && (!(flags & SPOTIFY_LOOKUP_LIST) || !(entry->type & sfs_playlist) || entry->playlist->materialized)) {
+        return entry;
+    }
+
+    /* not listed playlist or entry inside playlist which wasn't loaded yet */
+    spotify_unlock_directory();
+
+    if (inode_path(ino, path, sizeof(path)) < 0) {
+        spotify_lock_directory(flags & SPOTIFY_LOOKUP_WRITE);
+        return NULL;
+    }
+
+    return spotify_lookup(ctx, path, flags);
+}
+
+static void fuse_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    struct spotifs_context* ctx = get_app_context(req);
+    struct fuse_entry_param param;
+    struct sfs_entry *dir, *entry = NULL;
+    struct trace_start start;
+
+    trace_begin(&start);
+    g_debug("%s: %lu, %s", __func__, parent, name);
+
+    memset(&param, 0, sizeof(param));
+
+    /* looking inside a playlist needs its song list */
+    if ((dir = get_entry(ctx, parent, SPOTIFY_LOOKUP_LIST)) && (dir->type & sfs_directory)) {
+        entry = sfs_get_child_by_name(dir, name);
+    }
 
     if (entry) {
-        if (entry->type & sfs_track) {
-            stbuf->st_mode = S_IFREG | 0444;
-            stbuf->st_nlink = 1;
-        } else if (entry->type & sfs_directory) {
-            stbuf->st_mode = S_IFDIR | 0555;
-            stbuf->st_nlink = 2;
-        }
+        /* the number is kept until the kernel forgets this lookup */
+        fill_stat(entry, inode_lookup(entry), &param.attr);
+        param.ino = param.attr.st_ino;
+        param.attr_timeout = g_options.attr_timeout;
+        param.entry_timeout = g_options.entry_timeout;
+    } else {
+        /* zero inode makes the kernel cache missing name */
+        param.entry_timeout = g_options.negative_timeout;
+    }
 
-        stbuf->st_size = entry->size;
+    spotify_unlock_directory();
 
-        return 0;
+    if (entry || param.entry_timeout > 0) {
+        fuse_reply_entry(req, &param);
     } else {
-        return -ENOENT;
+        fuse_reply_err(req, ENOENT);
     }
+
+    finish_op(TRACE_LOOKUP, parent, name, 0, 0, entry ? 0 : -ENOENT, &start);
 }
 
-static int fuse_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-    off_t offset, struct fuse_file_info *fi)
+static void fuse_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
-    (void) offset;
-    (void) fi;
+    struct spotifs_context* ctx = get_app_context(req);
+    struct sfs_entry* entry;
+    struct trace_start start;
+    struct stat stbuf;
 
-    struct sfs_entry* dir;
-    g_debug("%s: %s", __func__, path);
+    trace_begin(&start);
+    entry = get_entry(ctx, ino, 0);
 
-    dir = sfs_get(spotify_get_root(), path);
+    if (entry) {
+        fill_stat(entry, ino, &stbuf);
+    }
+
+    spotify_unlock_directory();
+
+    if (entry) {
+        fuse_reply_attr(req, &stbuf, g_options.attr_timeout);
+    } else {
+        fuse_reply_err(req, ENOENT);
+    }
+
+    finish_op(TRACE_GETATTR, ino, NULL, 0, 0, entry ? 0 : -ENOENT, &start);
+}
+
+/* serialized entries of a directory, valid while its generation doesn't change */
+struct listing
+{
+    unsigned long generation;
+    int refs;
+    char* buffer;
+    /* position of entry at each offset, last one is the size of buffer */
+    size_t* positions;
+    off_t num_entries;
+};
 
-    g_debug("%s: dir name %s", __func__, dir->name);
+/* inode number -> listing, guarded by g_listings_lock */
+static GHashTable* g_listings = NULL;
+static pthread_mutex_t g_listings_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* g_listings_lock must be held, also used for values dropped from the table */
+static void unref_listing(struct listing* listing)
+{
+    if (!--listing->refs) {
+        free(listing->buffer);
+        free(listing->positions);
+        free(listing);
+    }
+}
 
-    if (dir && dir->type & sfs_directory) {
+static void put_listing(struct listing* listing)
+{
+    pthread_mutex_lock(&g_listings_lock);
+    unref_listing(listing);
+    pthread_mutex_unlock(&g_listings_lock);
+}
 
-        struct sfs_entry* item = dir->children;
+/* listing of the generation with a reference taken or NULL */
+static struct listing* get_listing(fuse_ino_t ino, unsigned long generation)
+{
+    struct listing* listing;
 
-        filler(buf, ".", NULL, 0);
-        filler(buf, "..", NULL, 0);
+    pthread_mutex_lock(&g_listings_lock);
 
-        while (item) {
-            g_debug("%s: name %s", __func__, item->name);
-            filler(buf, item->name, NULL, 0);
-            item = item->next;
+    if ((listing = g_hash_table_lookup(g_listings, GSIZE_TO_POINTER(ino)))) {
+        if (listing->generation == generation) {
+            listing->refs++;
+        } else {
+            listing = NULL;
         }
+    }
+
+    pthread_mutex_unlock(&g_listings_lock);
+
+    return listing;
+}
+
+static void fuse_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+{
+    /* freed number can be reused by another path, nothing cached for it may stay */
+    if (inode_forget(ino, nlookup)) {
+        pthread_mutex_lock(&g_listings_lock);
+        g_hash_table_remove(g_listings, GSIZE_TO_POINTER(ino));
+        pthread_mutex_unlock(&g_listings_lock);
+
+        trace_forget(ino);
+    }
+
+    fuse_reply_none(req);
+}
+
+/* offset of an entry is its index, "." and ".." come first */
+static struct sfs_entry* listing_item(struct sfs_entry* dir, off_t i, const char** name)
+{
+    if (i == 0) {
+        *name = ".";
+        return dir;
+    } else if (i == 1) {
+        *name = "..";
+        return dir->parent ? dir->parent : dir;
+    }
 
-        return 0;
+    *name = dir->child_array[i - 2]->name;
+    return dir->child_array[i - 2];
+}
+
+/* serialize whole directory and cache it, directory lock must be held */
+static struct listing* add_listing(fuse_req_t req, fuse_ino_t ino, struct sfs_entry* dir)
+{
+    struct listing* listing;
+    const char* name;
+    struct stat stbuf;
+    size_t used = 0;
+    off_t i;
+
+    if (!(listing = calloc(1, sizeof(struct listing)))) {
+        return NULL;
+    }
+
+    listing->generation = dir->generation;
+    listing->num_entries = dir->num_children + 2;
+
+    if (!(listing->positions = malloc((listing->num_entries + 1) * sizeof(size_t)))) {
+        free(listing);
+        return NULL;
+    }
+
+    for (i = 0; i < listing->num_entries; i++) {
+        listing->positions[i] = used;
+        listing_item(dir, i, &name);
+        used += fuse_add_direntry(req, NULL, 0, name, NULL, 0);
+    }
+
+    listing->positions[i] = used;
+
+    if (!(listing->buffer = malloc(used))) {
+        free(listing->positions);
+        free(listing);
+        return NULL;
+    }
+
+    for (i = 0; i < listing->num_entries; i++) {
+        struct sfs_entry* item = listing_item(dir, i, &name);
+
+        /* listing is cached under the number of the directory and dropped with
+         * it, numbers of the other items can change while it's kept. Kernel
+         * gets them by lookup. */
+        fill_stat(item, i ? FUSE_UNKNOWN_INO : ino, &stbuf);
+        fuse_add_direntry(req, listing->buffer + listing->positions[i],
+            listing->positions[i + 1] - listing->positions[i], name, &stbuf, i + 1);
+    }
+
+    /* one reference for the table, one for the caller */
+    listing->refs = 2;
+
+    /* listing of older generation is released by the table */
+    pthread_mutex_lock(&g_listings_lock);
+    g_hash_table_replace(g_listings, GSIZE_TO_POINTER(ino), listing);
+    pthread_mutex_unlock(&g_listings_lock);
+
+    return listing;
+}
+
+static void fuse_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+    struct spotifs_context* ctx = get_app_context(req);
+    struct listing* listing = NULL;
+    struct trace_start start;
+    struct sfs_entry* dir;
+    off_t last;
+    int ret = 0;
+
+    trace_begin(&start);
+    g_debug("%s: %lu, offset: %zu", __func__, ino, offset);
+
+    dir = get_entry(ctx, ino, SPOTIFY_LOOKUP_LIST);
+
+    if (!dir || !(dir->type & sfs_directory)) {
+        ret = dir ? -ENOTDIR : -ENOENT;
+    } else if ((listing = get_listing(ino, dir->generation))) {
+        stats_add(STATS_LISTING_HITS, 1);
+    } else if ((listing = add_listing(req, ino, dir))) {
+        /* listing is serialized once per change of the directory, paging only slices it */
+        stats_add(STATS_LISTING_MISSES, 1);
+    } else {
+        ret = -ENOMEM;
+    }
+
+    spotify_unlock_directory();
+
+    if (ret < 0) {
+        fuse_reply_err(req, -ret);
+    } else if (offset >= listing->num_entries) {
+        fuse_reply_buf(req, NULL, 0);
     } else {
-        return -ENOENT;
+        /* whole entries fitting into size */
+        for (last = offset; last < listing->num_entries
+            && listing->positions[last + 1] - listing->positions[offset] <= size; last++);
+
+        ret = listing->positions[last] - listing->positions[offset];
+        fuse_reply_buf(req, listing->buffer + listing->positions[offset], ret);
     }
+
+    if (listing) {
+        put_listing(listing);
+    }
+
+    finish_op(TRACE_READDIR, ino, NULL, offset, size, ret, &start);
 }
 
-int fuse_open(const char *filename, struct fuse_file_info *info)
+/*
+ * read-only directory with counters in Prometheus text format, so a textfile
+ * collector can scrape it straight from the mount. Contents are generated
+ * on open, reads of the open file see the same snapshot.
+ */
+#define STATS_DIRECTORY ".stats"
+#define STATS_FILE "spotifs.prom"
+
+static fuse_ino_t g_stats_ino = 0;
+
+/* directories and tracks below entry, directory lock must be held */
+static void count_entries(struct sfs_entry* dir, size_t* dirs, size_t* tracks)
 {
-    struct spotifs_context* ctx = get_app_context;
-    struct sfs_entry* track = sfs_get(spotify_get_root(), filename);
-    g_debug("%s: %s", __func__, filename);
+    struct sfs_entry* entry;
 
-    if (track && (track->type & sfs_track)) {
-        if (!track->track->refs) {
-            if (spotify_buffer_track(ctx, track->track) < 0) {
-                return -EIO;
-            }
+    for (entry = dir->children; entry; entry = entry->next) {
+        if (entry->type & sfs_directory) {
+            (*dirs)++;
+            count_entries(entry, dirs, tracks);
+        } else {
+            (*tracks)++;
         }
+    }
+}
 
-        track->track->refs ++;
-        info->fh = (uint64_t)track->track;
-        return 0;
-    } else {
-        return -ENOENT;
+static GString* generate_stats()
+{
+    GString* out = g_string_sized_new(8192);
+    struct sfs_entry* library;
+    size_t dirs = 0, tracks = 0, listings, listing_bytes = 0;
+    GHashTableIter iter;
+    gpointer listing;
+
+    stats_write(out);
+
+    spotify_lock_directory(0);
+
+    if ((library = spotify_get_playlists())) {
+        count_entries(library, &dirs, &tracks);
     }
+
+    spotify_write_stats(out);
+    spotify_unlock_directory();
+
+    stats_describe(out, "spotifs_tree_entries", "gauge", "Entries in the library, playlists are counted once listed.");
+    g_string_append_printf(out, "spotifs_tree_entries{type=\"directory\"} %zu\n", dirs);
+    g_string_append_printf(out, "spotifs_tree_entries{type=\"track\"} %zu\n", tracks);
+
+    pthread_mutex_lock(&g_listings_lock);
+    listings = g_hash_table_size(g_listings);
+    g_hash_table_iter_init(&iter, g_listings);
+
+    while (g_hash_table_iter_next(&iter, NULL, &listing)) {
+        listing_bytes += ((struct listing*)listing)->positions[((struct listing*)listing)->num_entries];
+    }
+
+    pthread_mutex_unlock(&g_listings_lock);
+
+    stats_describe(out, "spotifs_listings", "gauge", "Serialized directory listings kept for readdir.");
+    g_string_append_printf(out, "spotifs_listings %zu\n", listings);
+    stats_describe(out, "spotifs_listing_bytes", "gauge", "Size of serialized directory listings.");
+    g_string_append_printf(out, "spotifs_listing_bytes %zu\n", listing_bytes);
+
+    return out;
 }
 
-int fuse_release(const char *filename, struct fuse_file_info *info)
+/* stats file is regenerated by every open, size is unknown so reads go around the page cache */
+static void open_stats(fuse_req_t req, struct fuse_file_info *info)
 {
-    struct spotifs_context* ctx = get_app_context;
-    struct sfs_entry* track = sfs_get(spotify_get_root(), filename);
-    g_debug("%s: %s", __func__, filename);
+    info->fh = (uint64_t)generate_stats();
+    info->keep_cache = 0;
+    info->direct_io = 1;
 
-    if (track && (track->type & sfs_track)) {
-        track->track->refs --;
+    if (fuse_reply_open(req, info) < 0) {
+        g_string_free((GString*)info->fh, TRUE);
+    }
+}
 
-        if (!track->track->refs) {
-            spotify_buffer_stop(ctx, track->track);
+static int read_stats(fuse_req_t req, GString* stats, size_t size, off_t offset)
+{
+    if (offset >= stats->len) {
+        size = 0;
+    } else if (offset + size > stats->len) {
+        size = stats->len - offset;
+    }
+
+    fuse_reply_buf(req, stats->str + offset, size);
+
+    return size;
+}
+
+/* virtual directory is added next to the library, directory lock must be held */
+static void add_stats_directory(struct sfs_entry* root)
+{
+    struct sfs_entry* dir = sfs_add_child(root, STATS_DIRECTORY, sfs_directory);
+
+    g_stats_ino = inode_get(sfs_add_child(dir, STATS_FILE, 0));
+}
+
+static void remove_stats_directory(struct sfs_entry* root)
+{
+    size_t i;
+
+    for (i = 0; i < root->num_children; i++) {
+        if (!strcmp(root->child_array[i]->name, STATS_DIRECTORY)) {
+            sfs_free_entry(sfs_remove_child_at(root, i));
+            break;
         }
+    }
+
+    g_stats_ino = 0;
+}
+
+static void fuse_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *info)
+{
+    struct spotifs_context* ctx = get_app_context(req);
+    struct trace_start start;
+    struct sfs_entry* entry;
+    struct track* track = NULL;
+    int ret = 0;
+
+    trace_begin(&start);
+    g_debug("%s: %lu", __func__, ino);
+
+    if (ino == g_stats_ino) {
+        open_stats(req, info);
+        finish_op(TRACE_OPEN, ino, NULL, 0, 0, 0, &start);
+        return;
+    }
+
+    entry = get_entry(ctx, ino, SPOTIFY_LOOKUP_WRITE);
+
+    /* reference keeps the track valid after the lock is released, also when it's removed */
+    if (entry && (entry->type & sfs_track)) {
+        track = entry->track;
+        __atomic_add_fetch(&track->refs, 1, __ATOMIC_RELAXED);
+    } else {
+        ret = entry ? EISDIR : ENOENT;
+    }
+
+    spotify_unlock_directory();
 
-        return 0;
+    /* cache is read without the directory lock */
+    if (track && spotify_buffer_track(ctx, track) < 0) {
+        spotify_release_track(ctx, track);
+        ret = EIO;
+    }
+
+    if (!ret) {
+        info->fh = (uint64_t)track;
+        /* data of complete track never changes, page cache can always be kept */
+        info->keep_cache = g_options.kernel_cache || spotify_track_complete(track);
+
+        /* kernel takes short reads as end of file unless page cache is bypassed */
+        info->direct_io = spotify_partial_reads() || (info->flags & O_NONBLOCK);
+    }
+
+    if (ret) {
+        fuse_reply_err(req, ret);
+    } else if (fuse_reply_open(req, info) < 0) {
+        /* open was interrupted, release is not going to be called */
+        spotify_release_track(ctx, (struct track *)info->fh);
+    }
+
+    finish_op(TRACE_OPEN, ino, NULL, 0, 0, -ret, &start);
+}
+
+static void fuse_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *info)
+{
+    struct trace_start start;
+
+    /* entry could be already removed from the tree, track is still valid */
+    trace_begin(&start);
+    g_debug("%s: %lu", __func__, ino);
+
+    if (ino == g_stats_ino) {
+        g_string_free((GString*)info->fh, TRUE);
     } else {
-        return -ENOENT;
+        spotify_release_track(get_app_context(req), (struct track *)info->fh);
     }
+
+    fuse_reply_err(req, 0);
+
+    finish_op(TRACE_RELEASE, ino, NULL, 0, 0, 0, &start);
 }
 
-int fuse_read(const char *filename, char *buffer, size_t size, off_t offset, struct fuse_file_info *info)
+/* read replied when data arrives, data follows in the same allocation */
+struct read_request
 {
-    (void) filename;
+    fuse_req_t req;
+    fuse_ino_t ino;
+    off_t offset;
+    size_t size;
+    struct trace_start start;
+    char buffer[];
+};
 
-    struct spotifs_context* ctx = get_app_context;
+static void read_done(void* data, char* buffer, int result)
+{
+    struct read_request* request = data;
+
+    if (result < 0) {
+        fuse_reply_err(request->req, -result);
+    } else {
+        fuse_reply_buf(request->req, buffer, result);
+    }
+
+    finish_op(TRACE_READ, request->ino, NULL, request->offset, request->size, result, &request->start);
+    free(request);
+}
+
+static void fuse_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *info)
+{
+    struct spotifs_context* ctx = get_app_context(req);
     struct track* track = (struct track *)info->fh;
+    struct read_request* request;
+    struct trace_start start;
+    size_t available = size;
+    off_t position;
+    int fd;
+
+    trace_begin(&start);
+    g_debug("%s: %lu, size: %zu, offset: %zu", __func__, ino, size, offset);
+
+    if (ino == g_stats_ino) {
+        finish_op(TRACE_READ, ino, NULL, offset, size, read_stats(req, (GString*)info->fh, size, offset), &start);
+        return;
+    }
+
+    /* cached data is spliced straight from the file */
+    if ((fd = spotify_cached_range(track, offset, &available, &position)) >= 0) {
+        struct fuse_bufvec bufvec = FUSE_BUFVEC_INIT(available);
+
+        bufvec.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+        bufvec.buf[0].fd = fd;
+        bufvec.buf[0].pos = position;
+
+        fuse_reply_data(req, &bufvec, FUSE_BUF_SPLICE_MOVE);
+        stats_add(STATS_SPLICED_BYTES, available);
+        finish_op(TRACE_READ, ino, NULL, offset, size, available, &start);
+        return;
+    }
+
+    /* streamed track or header */
+    if (!(request = malloc(sizeof(struct read_request) + size))) {
+        fuse_reply_err(req, ENOMEM);
+        finish_op(TRACE_READ, ino, NULL, offset, size, -ENOMEM, &start);
+        return;
+    }
 
-    g_debug("%s: %s, size: %zu, offset: %zu", __func__, filename, size, offset);
+    request->req = req;
+    request->ino = ino;
+    request->offset = offset;
+    request->size = size;
+    request->start = start;
 
-    return spotify_read(ctx, track, offset, size, buffer);
+    /* reply can come from the worker thread, so this thread can serve other requests */
+    spotify_read_async(ctx, track, offset, size, request->buffer, info->flags & O_NONBLOCK ? SPOTIFY_READ_NONBLOCK : 0,
+        read_done, request);
 }
 
 // assemble list of callbacks
-struct fuse_operations spotifs_operations =
+static struct fuse_lowlevel_ops spotifs_operations =
 {
+    .lookup = fuse_lookup,
+    .forget = fuse_forget,
     .getattr = fuse_getattr,
     .readdir = fuse_readdir,
     .open = fuse_open,
     .release = fuse_release,
     .read = fuse_read,
 };
+
+/*
+ * kernel caches are invalidated by a separate thread, notifications must not
+ * be sent with directory lock held or from a request handler: kernel could
+ * wait for the request holding the directory inode lock
+ */
+struct invalidation
+{
+    fuse_ino_t parent;
+    fuse_ino_t ino;
+    char* name;
+    struct invalidation* next;
+};
+
+static struct fuse_chan* g_channel = NULL;
+static struct invalidation* g_invalidations = NULL;
+static struct invalidation** g_invalidations_tail = &g_invalidations;
+static int g_notifier_running = 0;
+/* changes of the tree are queued, guarded by directory lock */
+static int g_notifying = 0;
+static pthread_t g_notifier;
+static pthread_mutex_t g_invalidations_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_invalidations_cond = PTHREAD_COND_INITIALIZER;
+
+static void queue_invalidation(fuse_ino_t parent, fuse_ino_t ino, const char* name)
+{
+    struct invalidation* invalidation;
+
+    if (!(invalidation = malloc(sizeof(struct invalidation)))) {
+        return;
+    }
+
+    if (!(invalidation->name = strdup(name))) {
+        free(invalidation);
+        return;
+    }
+
+    invalidation->parent = parent;
+    invalidation->ino = ino;
+    invalidation->next = NULL;
+
+    pthread_mutex_lock(&g_invalidations_lock);
+
+    *g_invalidations_tail = invalidation;
+    g_invalidations_tail = &invalidation->next;
+
+    pthread_cond_signal(&g_invalidations_cond);
+    pthread_mutex_unlock(&g_invalidations_lock);
+}
+
+/* sfs change callback, directory lock is held */
+static void entry_changed(struct sfs_entry* entry)
+{
+    const fuse_ino_t parent = inode_find(entry->parent);
+    const fuse_ino_t ino = inode_find(entry);
+
+    /* kernel can't have anything cached for entries it never saw */
+    if (g_notifying && (parent || ino)) {
+        queue_invalidation(parent, ino, entry->name);
+    }
+
+    /* numbers keep pointing to the entries until they are removed or renamed */
+    inode_changed(entry);
+}
+
+static void* notifier_thread(void* arg)
+{
+    struct invalidation* invalidation;
+
+    pthread_mutex_lock(&g_invalidations_lock);
+
+    while (g_notifier_running || g_invalidations) {
+        if (!(invalidation = g_invalidations)) {
+            pthread_cond_wait(&g_invalidations_cond, &g_invalidations_lock);
+            continue;
+        }
+
+        if (!(g_invalidations = invalidation->next)) {
+            g_invalidations_tail = &g_invalidations;
+        }
+
+        pthread_mutex_unlock(&g_invalidations_lock);
+
+        /* dentry of the name (also a negative one) and attributes and pages of the inode having it now */
+        if (invalidation->parent) {
+            fuse_lowlevel_notify_inval_entry(g_channel, invalidation->parent, invalidation->name, strlen(invalidation->name));
+        }
+
+        if (invalidation->ino) {
+            fuse_lowlevel_notify_inval_inode(g_channel, invalidation->ino, 0, 0);
+        }
+
+        g_debug("%s: %lu, %s", __func__, invalidation->parent, invalidation->name);
+
+        free(invalidation->name);
+        free(invalidation);
+
+        pthread_mutex_lock(&g_invalidations_lock);
+    }
+
+    pthread_mutex_unlock(&g_invalidations_lock);
+
+    return NULL;
+}
+
+static void start_notifier(struct fuse_chan* channel)
+{
+    g_channel = channel;
+    g_notifier_running = 1;
+
+    if (pthread_create(&g_notifier, NULL, notifier_thread, NULL)) {
+        g_warning("%s: can't start notifier, kernel caches won't be invalidated", __func__);
+        g_notifier_running = 0;
+        return;
+    }
+
+    spotify_lock_directory(1);
+    g_notifying = 1;
+    spotify_unlock_directory();
+}
+
+static void stop_notifier()
+{
+    if (!g_notifier_running) {
+        return;
+    }
+
+    spotify_lock_directory(1);
+    g_notifying = 0;
+    spotify_unlock_directory();
+
+    /* queued invalidations are sent before exiting */
+    pthread_mutex_lock(&g_invalidations_lock);
+    g_notifier_running = 0;
+    pthread_cond_signal(&g_invalidations_cond);
+    pthread_mutex_unlock(&g_invalidations_lock);
+
+    pthread_join(g_notifier, NULL);
+}
+
+int fs_main(struct fuse_args* args, const struct fs_options* options, struct spotifs_context* ctx)
+{
+    struct fuse_session* session;
+    struct fuse_chan* channel;
+    char* mountpoint = NULL;
+    int multithreaded, foreground, ret = -1;
+
+    g_options = *options;
+
+    if (fuse_parse_cmdline(args, &mountpoint, &multithreaded, &foreground) < 0) {
+        return -1;
+    }
+
+    /* spotify worker thread is already running, so spotifs is never daemonized */
+    (void) foreground;
+
+    if (!mountpoint) {
+        /* help was requested, let the session list its options too */
+        if ((session = fuse_lowlevel_new(args, &spotifs_operations, sizeof(spotifs_operations), ctx))) {
+            fuse_session_destroy(session);
+        }
+
+        return -1;
+    }
+
+    if ((channel = fuse_mount(mountpoint, args))) {
+        if ((session = fuse_lowlevel_new(args, &spotifs_operations, sizeof(spotifs_operations), ctx))) {
+            if (fuse_set_signal_handlers(session) != -1) {
+                spotify_lock_directory(1);
+                inode_init(spotify_get_root());
+                sfs_set_change_callback(entry_changed);
+                add_stats_directory(spotify_get_root());
+                spotify_unlock_directory();
+
+                if (g_options.trace && trace_open(g_options.trace) < 0) {
+                    g_warning("%s: operations are not traced", __func__);
+                }
+                g_listings = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, (GDestroyNotify) unref_listing);
+                fuse_session_add_chan(session, channel);
+                start_notifier(channel);
+
+                ret = multithreaded ? fuse_session_loop_mt(session) : fuse_session_loop(session);
+
+                stop_notifier();
+
+                spotify_lock_directory(1);
+                remove_stats_directory(spotify_get_root());
+                spotify_unlock_directory();
+
+                fuse_remove_signal_handlers(session);
+                fuse_session_remove_chan(channel);
+                g_hash_table_destroy(g_listings);
+                trace_close();
+
+                /* worker could still change the tree */
+                spotify_lock_directory(1);
+                sfs_set_change_callback(NULL);
+                inode_release();
+                spotify_unlock_directory();
+            }
+
+            fuse_session_destroy(session);
+        }
+
+        fuse_unmount(mountpoint, channel);
+    }
+
+    free(mountpoint);
+
+    return ret;
+}
@@ -2,8 +2,24 @@
 #define SPOTIFS_FS_H
 
 #define FUSE_USE_VERSION 30
-#include <fuse.h>
+#include <fuse_lowlevel.h>
+#include "context.h"
 
-extern struct fuse_operations spotifs_operations;
+struct fs_options
+{
+    /* how long the kernel caches names, attributes and missing names, in seconds */
+    double entry_timeout;
+    double attr_timeout;
+    double negative_timeout;
+
+    /* keep page cache of a track between opens */
+    int kernel_cache;
+
+    /* file recording all operations, NULL if they're not traced */
+    char* trace;
+};
+
+/* mount and serve the filesystem until it's unmounted, FUSE options are taken from args */
+int fs_main(struct fuse_args* args, const struct fs_options* options, struct spotifs_context* ctx);
 
 #endif // SPOTIFS_FS_H
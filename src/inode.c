@@ -0,0 +1,344 @@
+#include "inode.h"
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
+#include <glib.h>
+
+struct inode
+{
+    /* NULL when the number is free */
+    char* path;
+    /* lookups replied to the kernel and not forgotten yet */
+    unsigned long nlookup;
+    /* number is never freed */
+    int pinned;
+    /* next free number, when this one is free */
+    uint64_t next_free;
+
+    /* entry having the number, which has it cached in entry->ino. Reset
+     * when the entry is removed or renamed, then it's looked up by path. */
+    struct sfs_entry* entry;
+};
+
+static struct sfs_entry* g_root = NULL;
+
+/* indexed by inode number, 0 is not used */
+static struct inode* g_inodes = NULL;
+static size_t g_num_inodes = 0;
+static size_t g_capacity = 0;
+/* forgotten numbers reused by new paths, 0 terminated */
+static uint64_t g_free_inodes = 0;
+
+/* path -> inode number, keys are owned by g_inodes */
+static GHashTable* g_numbers = NULL;
+
+static pthread_mutex_t g_inodes_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* full path of entry, written backwards from the end of the buffer */
+static int entry_path(struct sfs_entry* entry, char* path, size_t size)
+{
+    char* p = path + size - 1;
+
+    if (entry == g_root) {
+        strcpy(path, "/");
+        return 0;
+    }
+
+    *p = 0;
+
+    for (; entry != g_root; entry = entry->parent) {
+        size_t length;
+
+        /* entry detached from the tree */
+        if (!entry) {
+            return -1;
+        }
+
+        length = strlen(entry->name);
+
+        if (p - path < length + 1) {
+            return -1;
+        }
+
+        p -= length;
+        memcpy(p, entry->name, length);
+        *--p = '/';
+    }
+
+    memmove(path, p, path + size - p);
+
+    return 0;
+}
+
+/* attach entry to the number, other entry with the same path loses it. Lock is held. */
+static void bind_entry(uint64_t ino, struct sfs_entry* entry)
+{
+    struct inode* inode = &g_inodes[ino];
+
+    if (inode->entry && inode->entry != entry) {
+        inode->entry->ino = 0;
+    }
+
+    if (entry->ino && entry->ino != ino) {
+        g_inodes[entry->ino].entry = NULL;
+    }
+
+    inode->entry = entry;
+    entry->ino = ino;
+}
+
+/* number of the entry if its path has one, lock is held */
+static uint64_t find_inode(struct sfs_entry* entry)
+{
+    char path[PATH_MAX];
+    uint64_t ino;
+
+    if (entry->ino) {
+        return entry->ino;
+    }
+
+    if (!g_numbers || entry_path(entry, path, sizeof(path)) < 0) {
+        return 0;
+    }
+
+    if ((ino = GPOINTER_TO_SIZE(g_hash_table_lookup(g_numbers, path)))) {
+        bind_entry(ino, entry);
+    }
+
+    return ino;
+}
+
+static uint64_t add_inode(const char* path)
+{
+    uint64_t ino = g_free_inodes;
+
+    if (ino) {
+        if (!(g_inodes[ino].path = strdup(path))) {
+            return 0;
+        }
+
+        g_free_inodes = g_inodes[ino].next_free;
+        g_inodes[ino].next_free = 0;
+        g_hash_table_insert(g_numbers, g_inodes[ino].path, GSIZE_TO_POINTER(ino));
+
+        return ino;
+    }
+
+    if (g_num_inodes >= g_capacity) {
+        const size_t capacity = g_capacity ? g_capacity * 2 : 1024;
+        struct inode* inodes = realloc(g_inodes, capacity * sizeof(struct inode));
+
+        if (!inodes) {
+            return 0;
+        }
+
+        g_inodes = inodes;
+        g_capacity = capacity;
+    }
+
+    memset(&g_inodes[g_num_inodes], 0, sizeof(struct inode));
+
+    if (!(g_inodes[g_num_inodes].path = strdup(path))) {
+        return 0;
+    }
+
+    g_hash_table_insert(g_numbers, g_inodes[g_num_inodes].path, GSIZE_TO_POINTER(g_num_inodes));
+
+    return g_num_inodes++;
+}
+
+void inode_init(struct sfs_entry* root)
+{
+    g_root = root;
+    g_numbers = g_hash_table_new(g_str_hash, g_str_equal);
+
+    /* 0 is never a valid inode */
+    g_num_inodes = INODE_ROOT;
+    g_capacity = 0;
+    g_free_inodes = 0;
+
+    if (add_inode("/")) {
+        g_inodes[INODE_ROOT].pinned = 1;
+        bind_entry(INODE_ROOT, root);
+    }
+}
+
+void inode_release()
+{
+    size_t i;
+
+    if (g_numbers) {
+        g_hash_table_destroy(g_numbers);
+        g_numbers = NULL;
+    }
+
+    /* free numbers have NULL paths */
+    for (i = INODE_ROOT; i < g_num_inodes; i++) {
+        if (g_inodes[i].entry) {
+            g_inodes[i].entry->ino = 0;
+        }
+
+        free(g_inodes[i].path);
+    }
+
+    free(g_inodes);
+    g_inodes = NULL;
+    g_num_inodes = g_capacity = 0;
+    g_free_inodes = 0;
+}
+
+uint64_t inode_find(struct sfs_entry* entry)
+{
+    uint64_t ino;
+
+    pthread_mutex_lock(&g_inodes_lock);
+    ino = find_inode(entry);
+    pthread_mutex_unlock(&g_inodes_lock);
+
+    return ino;
+}
+
+/* number of the entry with a new one assigned if it has none, 0 on failure */
+static uint64_t assign_inode(struct sfs_entry* entry, int pin, unsigned long nlookup)
+{
+    char path[PATH_MAX];
+    uint64_t ino;
+
+    pthread_mutex_lock(&g_inodes_lock);
+
+    if (!(ino = find_inode(entry)) && entry_path(entry, path, sizeof(path)) == 0 && (ino = add_inode(path))) {
+        bind_entry(ino, entry);
+    }
+
+    if (ino) {
+        g_inodes[ino].pinned |= pin;
+        g_inodes[ino].nlookup += nlookup;
+    }
+
+    pthread_mutex_unlock(&g_inodes_lock);
+
+    return ino;
+}
+
+/* entries of the subtree lose their numbers, lock is held */
+static void unbind_entries(struct sfs_entry* entry)
+{
+    struct sfs_entry* child;
+
+    if (entry->ino) {
+        g_inodes[entry->ino].entry = NULL;
+        entry->ino = 0;
+    }
+
+    for (child = entry->children; child; child = child->next) {
+        unbind_entries(child);
+    }
+}
+
+void inode_changed(struct sfs_entry* entry)
+{
+    /* paths of the whole subtree change with a renamed directory */
+    pthread_mutex_lock(&g_inodes_lock);
+    unbind_entries(entry);
+    pthread_mutex_unlock(&g_inodes_lock);
+}
+
+uint64_t inode_get(struct sfs_entry* entry)
+{
+    return assign_inode(entry, 1, 0);
+}
+
+uint64_t inode_lookup(struct sfs_entry* entry)
+{
+    return assign_inode(entry, 0, 1);
+}
+
+int inode_forget(uint64_t ino, unsigned long nlookup)
+{
+    struct inode* inode;
+    int freed = 0;
+
+    pthread_mutex_lock(&g_inodes_lock);
+
+    if (ino > INODE_ROOT && ino < g_num_inodes && g_inodes[ino].path) {
+        inode = &g_inodes[ino];
+        inode->nlookup = nlookup < inode->nlookup ? inode->nlookup - nlookup : 0;
+
+        if (!inode->nlookup && !inode->pinned) {
+            /* entry is alive while it's bound, removal unbinds it first */
+            if (inode->entry) {
+                inode->entry->ino = 0;
+                inode->entry = NULL;
+            }
+
+            g_hash_table_remove(g_numbers, inode->path);
+            free(inode->path);
+            inode->path = NULL;
+            inode->next_free = g_free_inodes;
+            g_free_inodes = ino;
+            freed = 1;
+        }
+    }
+
+    pthread_mutex_unlock(&g_inodes_lock);
+
+    return freed;
+}
+
+struct sfs_entry* inode_entry(uint64_t ino)
+{
+    struct sfs_entry* entry = NULL;
+    char path[PATH_MAX];
+    int unbound = 0;
+
+    pthread_mutex_lock(&g_inodes_lock);
+
+    if (ino >= INODE_ROOT && ino < g_num_inodes && g_inodes[ino].path) {
+        entry = g_inodes[ino].entry;
+
+        /* entry was removed or renamed, path is looked up without the lock */
+        if (!entry && strlen(g_inodes[ino].path) < sizeof(path)) {
+            strcpy(path, g_inodes[ino].path);
+            unbound = 1;
+        }
+    }
+
+    pthread_mutex_unlock(&g_inodes_lock);
+
+    if (!unbound) {
+        return entry;
+    }
+
+    /* tree can't change, directory lock is held */
+    if (!(entry = sfs_get(g_root, path))) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&g_inodes_lock);
+
+    /* number could be forgotten and reused meanwhile */
+    if (ino < g_num_inodes && g_inodes[ino].path && !strcmp(g_inodes[ino].path, path)) {
+        bind_entry(ino, entry);
+    }
+
+    pthread_mutex_unlock(&g_inodes_lock);
+
+    return entry;
+}
+
+int inode_path(uint64_t ino, char* path, size_t size)
+{
+    int ret = -1;
+
+    pthread_mutex_lock(&g_inodes_lock);
+
+    if (ino >= INODE_ROOT && ino < g_num_inodes && g_inodes[ino].path && strlen(g_inodes[ino].path) < size) {
+        strcpy(path, g_inodes[ino].path);
+        ret = 0;
+    }
+
+    pthread_mutex_unlock(&g_inodes_lock);
+
+    return ret;
+}
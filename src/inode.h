@@ -0,0 +1,39 @@
+#ifndef SPOTIFS_INODE_H
+#define SPOTIFS_INODE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "sfs.h"
+
+/*
+ * stable inode numbers of sfs entries. Every path gets a number the first
+ * time its entry is looked up and keeps it while the tree is rebuilt, until
+ * the kernel forgets all its lookups. Forgotten numbers are reused, so they
+ * stay dense and entries are found through an array. Entries cache their
+ * numbers, which are looked up again by path only after inode_changed was
+ * called for the entry. The directory lock must be held by callers, number
+ * allocation has its own lock.
+ */
+
+/* number of the root passed to inode_init, same as FUSE_ROOT_ID */
+#define INODE_ROOT 1
+
+void inode_init(struct sfs_entry* root);
+void inode_release();
+
+/* number of the entry kept for the lifetime of the mount, 0 if the entry is not in the tree */
+uint64_t inode_get(struct sfs_entry* entry);
+/* number of the entry replied to a lookup, it's kept until inode_forget drops the lookup */
+uint64_t inode_lookup(struct sfs_entry* entry);
+/* kernel forgot nlookup lookups, returns 1 when the number was freed */
+int inode_forget(uint64_t ino, unsigned long nlookup);
+/* number of the entry without assigning one, 0 if kernel never got it */
+uint64_t inode_find(struct sfs_entry* entry);
+/* entry with the number or NULL if there's no such entry now */
+struct sfs_entry* inode_entry(uint64_t ino);
+/* entry is added, removed or renamed, numbers of its subtree are looked up by path again */
+void inode_changed(struct sfs_entry* entry);
+/* copy path of the number, returns -1 for unknown numbers */
+int inode_path(uint64_t ino, char* path, size_t size);
+
+#endif // SPOTIFS_INODE_H
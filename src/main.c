@@ -1,47 +1,117 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <unistd.h> // getopt
+#include <stddef.h>
+#include <fuse_opt.h>
 #include "fs.h"
 #include "spotify.h"
 #include "context.h"
 #include "logger.h"
+#include "cache.h"
+
+struct options
+{
+    char* username;
+    char* password;
+    char* cache_directory;
+    unsigned long cache_size;
+    int prefetch_threshold;
+    int short_reads;
+    int max_wait;
+    struct fs_options fs;
+    int help;
+};
+
+#define SPOTIFS_OPT(templ, field, value) { templ, offsetof(struct options, field), value }
+
+static const struct fuse_opt spotifs_opts[] = {
+    SPOTIFS_OPT("-u %s", username, 0),
+    SPOTIFS_OPT("-p %s", password, 0),
+    SPOTIFS_OPT("-c %s", cache_directory, 0),
+    SPOTIFS_OPT("-m %lu", cache_size, 0),
+    SPOTIFS_OPT("prefetch=%d", prefetch_threshold, 0),
+    SPOTIFS_OPT("short_reads", short_reads, 1),
+    SPOTIFS_OPT("max_wait=%d", max_wait, 0),
+    SPOTIFS_OPT("entry_timeout=%lf", fs.entry_timeout, 0),
+    SPOTIFS_OPT("attr_timeout=%lf", fs.attr_timeout, 0),
+    SPOTIFS_OPT("negative_timeout=%lf", fs.negative_timeout, 0),
+    SPOTIFS_OPT("kernel_cache", fs.kernel_cache, 1),
+    SPOTIFS_OPT("no_kernel_cache", fs.kernel_cache, 0),
+    SPOTIFS_OPT("trace=%s", fs.trace, 0),
+    SPOTIFS_OPT("-h", help, 1),
+    SPOTIFS_OPT("--help", help, 1),
+    FUSE_OPT_END
+};
+
+/*
+ * FUSE defaults for read-only streaming, inserted before user arguments so
+ * they can be overridden
+ */
+static const char* default_arguments[] = {
+    "-oro,fsname=spotifs,subtype=spotifs",
+    "-omax_read=131072,max_readahead=1048576,async_read",
+    "-osplice_read,splice_move",
+};
 
 void print_usage_and_exit(void)
 {
-    fprintf(stderr, "Usage is: spotifs -u username -p password /mount/point\n\n");
+    fprintf(stderr, "Usage is: spotifs -u username -p password [-c cache/directory [-m cache size in MB]] [options] /mount/point\n\n"
+        "spotifs options:\n"
+        "    -o prefetch=PERCENT    prefetch next track when current one is buffered in PERCENT (75), 0 disables\n"
+        "    -o short_reads         return already buffered data instead of waiting for whole read\n"
+        "    -o max_wait=MS         return short read after waiting MS for whole read\n"
+        "    -o entry_timeout=T     cache names for T seconds (3600)\n"
+        "    -o attr_timeout=T      cache attributes for T seconds (3600)\n"
+        "    -o negative_timeout=T  cache missing names for T seconds (60)\n"
+        "    -o [no_]kernel_cache   keep page cache of partially streamed tracks between opens (on)\n"
+        "    -o trace=FILE          record all operations into FILE for bench/trace_replay\n\n"
+        "Other options are passed to FUSE (spotifs -h lists them), defaults are:\n"
+        "    -o ro,max_read=131072,max_readahead=1048576,async_read,splice_read,splice_move\n\n");
     exit(-1);
 }
 
 int main(int argc, char **argv)
 {
-    int option = 0;
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    /* track data never changes and tree changes are sent to the kernel,
+     * so names, attributes and pages can be cached for long */
+    struct options options = {
+        .cache_size = 1024,
+        .prefetch_threshold = 75,
+        .fs = {
+            .entry_timeout = 3600,
+            .attr_timeout = 3600,
+            .negative_timeout = 60,
+            .kernel_cache = 1,
+        },
+    };
     int result = EXIT_SUCCESS;
-    const char* username = NULL;
-    const char* password = NULL;
+    size_t i;
 
-    while((option = getopt(argc, argv, "u:p:")) != -1)
-    {
-        switch(option)
-        {
-        case 'u':
-            username = optarg;
-            break;
-
-        case 'p':
-            password = optarg;
-            break;
+    if (fuse_opt_parse(&args, &options, spotifs_opts, NULL) < 0) {
+        print_usage_and_exit();
+    }
 
-        default:
-            print_usage_and_exit();
-        }
+    if (options.help) {
+        /* let FUSE list its own options before ours */
+        fuse_opt_add_arg(&args, "-ho");
+        fs_main(&args, &options.fs, NULL);
+        print_usage_and_exit();
     }
 
-    if (!username || !password || argc != (1+optind))
+    if (!options.username || !options.password)
     {
         print_usage_and_exit();
     }
 
+    for (i = 0; i < sizeof(default_arguments) / sizeof(default_arguments[0]); i++) {
+        fuse_opt_insert_arg(&args, 1 + i, default_arguments[i]);
+    }
+
+    spotify_set_prefetch_threshold(options.prefetch_threshold);
+    spotify_set_short_reads(options.short_reads);
+    spotify_set_max_wait(options.max_wait);
+
     struct spotifs_context context = {0};
 
     pthread_mutexattr_t attr;
@@ -49,12 +119,15 @@ int main(int argc, char **argv)
     pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
 
     pthread_mutex_init(&context.lock, NULL);
-    pthread_cond_init(&context.change, NULL);
 
     logger_set_stream(stdout);
 
+    if (options.cache_directory && cache_init(options.cache_directory, options.cache_size * 1024 * 1024) < 0) {
+        fprintf(stderr, "Can't use cache directory '%s'\n", options.cache_directory);
+    }
+
     // login to spotify service
-    if (spotify_connect(&context, username, password) < 0) {
+    if (spotify_connect(&context, options.username, options.password) < 0) {
         result = -1;
     } else {
         // create logger (aka. log file)
@@ -65,19 +138,14 @@ int main(int argc, char **argv)
         }*/
 
         // run fuse
-        char *arguments[5];
-        arguments[0] = argv[0];
-        arguments[1] = "-f";
-        //arguments[2] = "-d";
-        arguments[2] = argv[optind];
-        arguments[3] = NULL;
-
-        result = fuse_main(3, arguments, &spotifs_operations, &context);
+        result = fs_main(&args, &options.fs, &context);
 
         // logout and release spotify session
         spotify_disconnect(&context);
     }
 
+    fuse_opt_free_args(&args);
+
     logger_stop();
     return result;
 }
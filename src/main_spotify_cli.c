@@ -2,6 +2,8 @@
 
 #include <glib.h>
 #include <string.h>
+#include <unistd.h>
+#include <limits.h>
 #include "spotify.h"
 #include "sfs.h"
 
@@ -63,7 +65,12 @@ int main(int argc, char **argv)
             if (args[0] != NULL) list_index = atoi(args[0]);
 
             if (list_index > 0) {
-                list = sfs_get_child_by_index(list, list_index - 1)->children;
+                char path[PATH_MAX];
+
+                snprintf(path, sizeof(path), "/library/%s", sfs_get_child_by_index(list, list_index - 1)->name);
+                list = spotify_lookup(&spotify_context, path, SPOTIFY_LOOKUP_LIST);
+                list = list ? list->children : NULL;
+                spotify_unlock_directory();
 
                 while (list) {
                     g_print("Song %d: %s\n", index, list->name);
@@ -94,6 +101,12 @@ int main(int argc, char **argv)
             song = atoi(args[1]);
 
             list = sfs_get_child_by_index(list, playlist - 1);
+
+            if (list && !list->playlist->materialized) {
+                g_print("list the playlist first\n");
+                continue;
+            }
+
             list = sfs_get_child_by_index(list, song - 1);
 
             g_print("starting download of %s\n", list->name);
@@ -101,8 +114,13 @@ int main(int argc, char **argv)
         } else if (!strcmp(command, "watch")) {
             struct track* current = spotify_current(&spotify_context);
 
-            while (current->buffer.pointer < current->size - 44 /* HACK :D */ ) {
-                g_print("Buffer, size: %zu, track size: %d\n", current->buffer.pointer, current->size);
+            if (!current) {
+                g_print("No track is loaded into the player\n");
+                continue;
+            }
+
+            while (buffer_available(&current->buffer, 0) < current->buffer.capacity) {
+                g_print("Buffer, size: %zu, track size: %d\n", buffer_filled(&current->buffer), current->size);
                 sleep(1);
             }
         }
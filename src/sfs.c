@@ -1,87 +1,360 @@
 #include "sfs.h"
 #include <string.h>
 #include <malloc.h>
+#include <limits.h>
+#include <pthread.h>
+
+/* guards path caches, lookups can come from many FUSE threads at once */
+static pthread_mutex_t g_paths_lock = PTHREAD_MUTEX_INITIALIZER;
 
 struct sfs_entry* sfs_get(struct sfs_entry* root, const char* path)
 {
     if (!strcmp("/", path)) {
         return root;
     } else {
-        char* copy = strdup(path);
-        char* p = strtok(copy, "/");
-        struct sfs_entry* entry = root->children;
-
-        while (entry) {
-            if (!strcmp(entry->name, p)) {
-                /* component found */
-                p = strtok(NULL, "/");
-
-                if (!p) {
-                    /* no more subdirs */
-                    free(copy);
-                    return entry;
-                } else {
-                    entry = entry->children;
-                }
-            } else {
-                entry = entry->next;
+        char name[NAME_MAX + 1];
+        struct sfs_entry* entry = NULL;
+        const char* p = path;
+
+        pthread_mutex_lock(&g_paths_lock);
+
+        if (root->paths) {
+            entry = g_hash_table_lookup(root->paths, path);
+        }
+
+        pthread_mutex_unlock(&g_paths_lock);
+
+        if (entry) {
+            return entry;
+        }
+
+        entry = root;
+
+        /* walk path component by component */
+        while (*p) {
+            const char* end;
+
+            while (*p == '/') {
+                p++;
+            }
+
+            if (!*p) {
+                break;
+            }
+
+            for (end = p; *end && *end != '/'; end++);
+
+            if (end - p > NAME_MAX) {
+                return NULL;
             }
+
+            memcpy(name, p, end - p);
+            name[end - p] = 0;
+
+            if (!(entry = sfs_get_child_by_name(entry, name))) {
+                return NULL;
+            }
+
+            p = end;
         }
 
-        free(copy);
-        return NULL;
+        /* only existing entries are cached, cache is dropped when entries go away */
+        pthread_mutex_lock(&g_paths_lock);
+
+        if (!root->paths) {
+            root->paths = g_hash_table_new_full(g_str_hash, g_str_equal, free, NULL);
+        }
+
+        g_hash_table_replace(root->paths, strdup(path), entry);
+
+        pthread_mutex_unlock(&g_paths_lock);
+
+        return entry;
     }
 }
 
 struct sfs_entry* sfs_add_child(struct sfs_entry* root, const char* name, int type)
 {
-    struct sfs_entry* entry = malloc(sizeof(struct sfs_entry));
+    return sfs_add_child_in(root, NULL, name, type);
+}
 
-    entry->next = NULL;
-    entry->name = strdup(name);
-    entry->size = 0;
-    entry->type = type;
-    entry->children = NULL;
+struct sfs_entry* sfs_add_child_in(struct sfs_entry* root, struct arena* arena, const char* name, int type)
+{
+    struct sfs_entry* entry = sfs_new_entry(arena, name, type);
+
+    return entry ? sfs_add_child_entry(root, entry) : NULL;
+}
+
+struct sfs_entry* sfs_new_entry(struct arena* arena, const char* name, int type)
+{
+    struct sfs_entry* entry;
+
+    if (arena) {
+        entry = arena_alloc(arena, sizeof(struct sfs_entry));
+    } else {
+        entry = malloc(sizeof(struct sfs_entry));
+    }
+
+    if (!entry) {
+        return NULL;
+    }
+
+    memset(entry, 0, sizeof(struct sfs_entry));
+
+    if (arena) {
+        entry->name = arena_strdup(arena, name);
+        entry->type = type | sfs_arena;
+    } else {
+        entry->name = strdup(name);
+        entry->type = type;
+    }
+
+    return entry;
+}
+
+static sfs_change_callback g_change_callback = NULL;
+
+void sfs_set_change_callback(sfs_change_callback callback)
+{
+    g_change_callback = callback;
+}
+
+static void notify_change(struct sfs_entry* entry)
+{
+    if (g_change_callback) {
+        g_change_callback(entry);
+    }
+}
+
+static void bump_generation(struct sfs_entry* entry)
+{
+    for (; entry; entry = entry->parent) {
+        entry->generation++;
+    }
+}
+
+/* cached paths could point to removed entries, drop caches of all ancestors */
+static void invalidate_paths(struct sfs_entry* entry)
+{
+    bump_generation(entry);
+
+    pthread_mutex_lock(&g_paths_lock);
+
+    for (; entry; entry = entry->parent) {
+        if (entry->paths) {
+            g_hash_table_remove_all(entry->paths);
+        }
+    }
+
+    pthread_mutex_unlock(&g_paths_lock);
+}
+
+void sfs_free_entry(struct sfs_entry* entry)
+{
+    sfs_remove_children(entry);
+
+    if (entry->index) g_hash_table_destroy(entry->index);
+    if (entry->paths) g_hash_table_destroy(entry->paths);
+    free(entry->child_array);
+
+    if (!(entry->type & sfs_arena)) {
+        free(entry->name);
+        free(entry);
+    }
+}
+
+void sfs_remove_children(struct sfs_entry* root)
+{
+    struct sfs_entry* entry = root->children;
+
+    if (!entry) {
+        return;
+    }
+
+    root->children = NULL;
+    root->last = NULL;
+    root->num_children = 0;
 
-    return sfs_add_child_entry(root, entry);
+    if (root->index) {
+        g_hash_table_remove_all(root->index);
+    }
+
+    invalidate_paths(root);
+
+    while (entry) {
+        struct sfs_entry* next = entry->next;
+        notify_change(entry);
+        entry->parent = NULL;
+        sfs_free_entry(entry);
+        entry = next;
+    }
 }
 
 struct sfs_entry* sfs_add_child_entry(struct sfs_entry* root, struct sfs_entry* entry)
 {
-    entry->next = NULL;
+    return sfs_insert_child_entry(root, entry, root->num_children);
+}
+
+static void index_add(struct sfs_entry* root, struct sfs_entry* entry)
+{
+    if (!root->index) {
+        root->index = g_hash_table_new(g_str_hash, g_str_equal);
+    }
 
-    if (root->children) {
-        struct sfs_entry *current = root->children;
+    /* first of entries with the same name wins, as in linear lookup */
+    if (!g_hash_table_contains(root->index, entry->name)) {
+        g_hash_table_insert(root->index, entry->name, entry);
+    }
+}
+
+static void index_remove(struct sfs_entry* root, struct sfs_entry* entry)
+{
+    size_t i;
+
+    if (g_hash_table_lookup(root->index, entry->name) != entry) {
+        return;
+    }
+
+    g_hash_table_remove(root->index, entry->name);
 
-        while (current->next) {
-            current = current->next;
+    /* another child with the same name becomes visible */
+    for (i = 0; i < root->num_children; i++) {
+        if (root->child_array[i] != entry && !strcmp(root->child_array[i]->name, entry->name)) {
+            g_hash_table_insert(root->index, root->child_array[i]->name, root->child_array[i]);
+            break;
         }
+    }
+}
 
-        current->next = entry;
+struct sfs_entry* sfs_insert_child_entry(struct sfs_entry* root, struct sfs_entry* entry, size_t index)
+{
+    if (index > root->num_children) {
+        index = root->num_children;
+    }
+
+    if (root->num_children == root->children_capacity) {
+        const size_t capacity = root->children_capacity ? root->children_capacity * 2 : 8;
+        struct sfs_entry** array = realloc(root->child_array, capacity * sizeof(struct sfs_entry*));
+
+        if (!array) {
+            return NULL;
+        }
+
+        root->child_array = array;
+        root->children_capacity = capacity;
+    }
+
+    entry->parent = root;
+    index_add(root, entry);
+
+    if (index == root->num_children) {
+        /* append, most common case */
+        entry->next = NULL;
+
+        if (root->last) {
+            root->last->next = entry;
+        } else {
+            root->children = entry;
+        }
+
+        root->last = entry;
     } else {
-        root->children = entry;
+        entry->next = root->child_array[index];
+
+        if (index) {
+            root->child_array[index - 1]->next = entry;
+        } else {
+            root->children = entry;
+        }
+
+        memmove(root->child_array + index + 1, root->child_array + index,
+            (root->num_children - index) * sizeof(struct sfs_entry*));
     }
 
+    root->child_array[index] = entry;
+    root->num_children++;
+
+    bump_generation(root);
+    notify_change(entry);
+
     return entry;
 }
 
-struct sfs_entry* sfs_add_subdirectory(struct sfs_entry* root, const char* name)
+struct sfs_entry* sfs_remove_child_at(struct sfs_entry* root, size_t index)
 {
-    struct sfs_entry* entry = malloc(sizeof(struct sfs_entry));
+    struct sfs_entry* entry;
+
+    if (index >= root->num_children) {
+        return NULL;
+    }
+
+    entry = root->child_array[index];
+
+    if (index) {
+        root->child_array[index - 1]->next = entry->next;
+    } else {
+        root->children = entry->next;
+    }
+
+    if (root->last == entry) {
+        root->last = index ? root->child_array[index - 1] : NULL;
+    }
+
+    memmove(root->child_array + index, root->child_array + index + 1,
+        (root->num_children - index - 1) * sizeof(struct sfs_entry*));
+    root->num_children--;
+
+    index_remove(root, entry);
+    invalidate_paths(root);
+    notify_change(entry);
 
     entry->next = NULL;
-    entry->type = sfs_directory;
-    entry->name = strdup(name);
-    entry->size = 0;
-    entry->children = NULL;
+    entry->parent = NULL;
 
-    return sfs_add_child_entry(root, entry);
+    return entry;
+}
+
+void sfs_rename(struct sfs_entry* entry, struct arena* arena, const char* name)
+{
+    struct sfs_entry* root = entry->parent;
+    char* copy = arena ? arena_strdup(arena, name) : strdup(name);
+
+    if (!copy) {
+        return;
+    }
+
+    if (root) {
+        notify_change(entry);
+        index_remove(root, entry);
+        invalidate_paths(root);
+    }
+
+    /* name of arena entry is released together with its arena */
+    if (!(entry->type & sfs_arena)) {
+        free(entry->name);
+    }
+
+    entry->name = copy;
+
+    if (root) {
+        index_add(root, entry);
+        notify_change(entry);
+    }
+}
+
+struct sfs_entry* sfs_add_subdirectory(struct sfs_entry* root, const char* name)
+{
+    return sfs_add_child(root, name, sfs_directory);
 }
 
 struct sfs_entry* sfs_get_child_by_name(struct sfs_entry* root, const char* name)
 {
     struct sfs_entry* entry = root->children;
 
+    if (root->index) {
+        return g_hash_table_lookup(root->index, name);
+    }
+
     while (entry) {
         if (!strcmp(entry->name, name)) {
             return entry;
@@ -95,17 +368,9 @@ struct sfs_entry* sfs_get_child_by_name(struct sfs_entry* root, const char* name
 
 struct sfs_entry* sfs_get_child_by_index(struct sfs_entry* root, int index)
 {
-    struct sfs_entry* entry = root->children;
-    int i = 0;
-
-    while (entry) {
-        if (i == index) {
-            return entry;
-        } else {
-            entry = entry->next;
-            i++;
-        }
+    if (index < 0 || index >= root->num_children) {
+        return NULL;
     }
 
-    return NULL;
+    return root->child_array[index];
 }
@@ -2,6 +2,9 @@
 #define SPOTIFS_SFS_H
 
 #include <stdlib.h>
+#include <stdint.h>
+#include <glib.h>
+#include "arena.h"
 
 struct track;
 struct playlist;
@@ -10,7 +13,9 @@ enum sfs_type {
     sfs_directory = 1 << 0,
     sfs_track = 1 << 1,
     sfs_playlist = 1 << 2,
-    sfs_container = 1 << 3
+    sfs_container = 1 << 3,
+    /* entry and its name are allocated in an arena */
+    sfs_arena = 1 << 4
 };
 
 struct sfs_entry {
@@ -20,6 +25,24 @@ struct sfs_entry {
 
     struct sfs_entry* next;
     struct sfs_entry* children;
+    struct sfs_entry* parent;
+
+    /* last child and all children in order, for O(1) append and access by index */
+    struct sfs_entry* last;
+    struct sfs_entry** child_array;
+    size_t num_children;
+    size_t children_capacity;
+
+    /* children of directory by name */
+    GHashTable* index;
+    /* full path -> entry cache, used only on the root passed to sfs_get */
+    GHashTable* paths;
+
+    /* bumped whenever anything below the entry is added, removed or renamed */
+    unsigned long generation;
+
+    /* inode number cached by inode.c, 0 when the entry has none */
+    uint64_t ino;
 
     union {
         struct track* track;
@@ -30,6 +53,24 @@ struct sfs_entry {
 struct sfs_entry* sfs_get(struct sfs_entry* root, const char* path);
 struct sfs_entry* sfs_add_child_entry(struct sfs_entry* root, struct sfs_entry* entry);
 struct sfs_entry* sfs_add_child(struct sfs_entry* root, const char* name, int type);
+struct sfs_entry* sfs_add_child_in(struct sfs_entry* root, struct arena* arena, const char* name, int type);
+struct sfs_entry* sfs_insert_child_entry(struct sfs_entry* root, struct sfs_entry* entry, size_t index);
+/* detached entry, arena can be NULL to allocate it on the heap */
+struct sfs_entry* sfs_new_entry(struct arena* arena, const char* name, int type);
+/* detach child from root, it can be freed with sfs_free_entry */
+struct sfs_entry* sfs_remove_child_at(struct sfs_entry* root, size_t index);
+void sfs_free_entry(struct sfs_entry* entry);
+/* detach and free whole subtree below root, arena allocated memory is left to its arena */
+void sfs_remove_children(struct sfs_entry* root);
+
+/*
+ * called for every entry added, removed or renamed (once with the old and
+ * once with the new name) while it's attached under the changed name
+ */
+typedef void (*sfs_change_callback)(struct sfs_entry* entry);
+void sfs_set_change_callback(sfs_change_callback callback);
+/* arena is used for the new name, as for sfs_new_entry */
+void sfs_rename(struct sfs_entry* entry, struct arena* arena, const char* name);
 struct sfs_entry* sfs_add_subdirectory(struct sfs_entry* root, const char* name);
 struct sfs_entry* sfs_get_child_by_name(struct sfs_entry* root, const char* name);
 struct sfs_entry* sfs_get_child_by_index(struct sfs_entry* root, int index);
@@ -6,22 +6,66 @@
 #include <string.h>
 #include <assert.h>
 #include <errno.h>
+#include <limits.h>
+#include <unistd.h>
 #include <sys/time.h>
 #include <math.h>
 #include <glib.h>
 #include "support.h"
 #include "sfs.h"
 #include "wave.h"
-
+#include "cache.h"
+#include "stats.h"
+
+/* tracks opened for buffering, all of them share single player */
+static struct track* g_open_tracks = NULL;
+/* stopped tracks with their pin handed over to worker, which drops the spotify reference */
+static struct track* g_stopped_tracks = NULL;
+/* track loaded into the player and time when it got it */
 static struct track* g_current_track = NULL;
+static struct timespec g_current_track_since;
+/* player has a track loaded, also one which was stopped and wasn't unloaded by worker yet */
+static int g_player_loaded = 0;
 static pthread_mutex_t current_track_mutex = PTHREAD_MUTEX_INITIALIZER;
 static pthread_mutexattr_t current_track_mutex_attr;
-static pthread_cond_t current_track_cond = PTHREAD_COND_INITIALIZER;
+
+/* time the player started streaming, 0 while it's stopped, and audio delivered since, in ns; guarded by current_track_mutex */
+static uint64_t g_playing_since = 0;
+static uint64_t g_playing_delivered = 0;
+
+/* when login was requested, how long it took and how long the playlist container loaded after it, in ns */
+static uint64_t g_login_started = 0;
+static uint64_t g_login_ns = 0;
+static uint64_t g_container_load_ns = 0;
+
+/* reads starting further than this from the buffered data are seeked to */
+#define SEEK_THRESHOLD_MS 3000
+
+/* how long track keeps the player while other open tracks need it */
+#define PLAYER_TIME_SLICE_MS 5000
+/* track which wasn't loaded yet is retried after metadata is updated or after this time */
+#define PLAYER_LOAD_RETRY_MS 1000
+
+/* percent of current track buffered after which next track in directory is prefetched */
+static int g_prefetch_threshold = 75;
+
+/* reads return data already buffered instead of waiting for the whole range */
+static int g_short_reads = 0;
+/* longest time a read waits for the whole range before returning a short read, 0 waits forever */
+static int g_max_wait_ms = 0;
+
+/* beginning of next track decoded ahead, before anybody opens it */
+#define PREFETCH_DECODE_MS 10000
+
+/* next track held open by prefetching, changed with both directory lock and current_track_mutex held */
+static struct track* g_prefetched_track = NULL;
+/* track which crossed the prefetch threshold, guarded by current_track_mutex */
+static struct track* g_prefetch_request = NULL;
 
 /* global playlist lock */
 struct sfs_entry_list {
     struct sfs_entry first;
-    pthread_mutex_t lock;
+    pthread_rwlock_t lock;
 };
 
 static struct sfs_entry_list g_directory = {
@@ -31,13 +75,42 @@ static struct sfs_entry_list g_directory = {
                 .size = 0,
                 .children = NULL
         },
-        .lock = PTHREAD_MUTEX_INITIALIZER
+        .lock = PTHREAD_RWLOCK_INITIALIZER
+};
+
+/* memory of playlist entries, released when playlists are initialized again */
+static struct arena g_playlists_arena = ARENA_INITIALIZER(16 * 1024);
+/* memory of a released playlist which still had open tracks, freed when the last one is closed */
+struct retired_arena
+{
+    struct arena arena;
+    /* tracks of the arena which are open, guarded by directory lock */
+    int open;
+    struct retired_arena* next;
 };
 
+static struct retired_arena* g_retired_arenas = NULL;
+/* memory of released playlists kept until disconnect, when there was no memory to track it */
+static struct arena g_retired_arena = ARENA_INITIALIZER(64 * 1024);
+
 /* worker thread variables */
 static pthread_t spotify_worker_thread_handle;
 
 struct sfs_entry* spotify_get_root() { return &g_directory.first; }
+
+void spotify_lock_directory(int write)
+{
+    if (write) {
+        pthread_rwlock_wrlock(&g_directory.lock);
+    } else {
+        pthread_rwlock_rdlock(&g_directory.lock);
+    }
+}
+
+void spotify_unlock_directory()
+{
+    pthread_rwlock_unlock(&g_directory.lock);
+}
 struct sfs_entry* spotify_get_playlists()
 {
     struct sfs_entry* entry = spotify_get_root()->children;
@@ -53,304 +126,1805 @@ struct sfs_entry* spotify_get_playlists()
     return NULL;
 }
 
-static void* spotify_worker_thread(void *param)
+static void wake_worker(struct spotifs_context* ctx)
 {
-    struct spotifs_context* ctx = param;
-    struct timespec timeout;
+    pthread_mutex_lock(&ctx->lock);
 
-    int next_timeout = 0;
-    sp_error err;
+    /* worker is already going to process events, no need to signal again */
+    if (!ctx->spotify_event) {
+        ctx->spotify_event = 1;
+        pthread_cond_signal(&ctx->change);
+    }
 
-    ctx->spotify_event = 1;
-    clock_gettime(CLOCK_REALTIME, &timeout);
-    timeout.tv_sec += 1;
+    pthread_mutex_unlock(&ctx->lock);
+}
 
-    while (ctx->worker_running)
-    {
-        pthread_mutex_lock(&ctx->lock);
+static long elapsed_ms(const struct timespec* since)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
 
-        while (!ctx->spotify_event) {
-            /*if (timeout.tv_nsec < 0 || timeout.tv_nsec > 1000000000L) {
-                timeout.tv_nsec = 0;
-                timeout.tv_sec ++;
-            }*/
+    return (now.tv_sec - since->tv_sec) * 1000 + (now.tv_nsec - since->tv_nsec) / 1000000;
+}
 
-            timeout.tv_sec ++;
+static long elapsed_us(const struct timespec* since)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
 
-            if (pthread_cond_timedwait(&ctx->change, &ctx->lock, &timeout) == ETIMEDOUT) {
-                g_debug("%s: timedout", __func__);
-                break;
-            }
+    return (now.tv_sec - since->tv_sec) * 1000000 + (now.tv_nsec - since->tv_nsec) / 1000;
+}
+
+static void timespec_add_ms(struct timespec* time, int ms)
+{
+    time->tv_sec += ms / 1000;
+    time->tv_nsec += (ms % 1000) * 1000000L;
+
+    if (time->tv_nsec >= 1000000000L) {
+        time->tv_nsec -= 1000000000L;
+        time->tv_sec++;
+    }
+}
+
+/* some open track other than the given one has readers waiting, current_track_mutex must be held */
+static int other_track_waited_for(struct track* track)
+{
+    struct track* other;
+
+    for (other = g_open_tracks; other; other = other->next_open) {
+        if (other != track && other->waiters) {
+            return 1;
         }
+    }
 
-        ctx->spotify_event = 0;
+    return 0;
+}
 
-        pthread_mutex_unlock(&ctx->lock);
+/* track has readers waiting or is not buffered up to the end yet */
+static int track_wants_player(struct track* track)
+{
+    if (track->error) {
+        return 0;
+    }
 
-        do {
-            err = sp_session_process_events(ctx->spotify_session, &next_timeout);
-        } while(next_timeout == 0 && err == SP_ERROR_OK);
+    /* other tracks can use the player while metadata of this one is loading */
+    if (track->loading && elapsed_ms(&track->loading_since) < PLAYER_LOAD_RETRY_MS) {
+        return 0;
+    }
+
+    /* nobody but prefetching opened the track, only its beginning is needed and only when the player is free */
+    if (track == g_prefetched_track && __atomic_load_n(&track->refs, __ATOMIC_RELAXED) == 1
+        && (other_track_waited_for(track) || (buffer_is_initialized(&track->buffer)
+            && track->buffer.write_pointer >= wave_ms_to_offset(2, track->channels, track->sample_rate, PREFETCH_DECODE_MS)))) {
+        return 0;
+    }
+
+    return track->waiters
+        || !buffer_is_initialized(&track->buffer)
+        || track->buffer.write_pointer < track->buffer.capacity;
+}
+
+/* reader sleeping until [offset, offset + size) is buffered */
+struct track_waiter
+{
+    off_t offset;
+    size_t size;
+    int woken;
+    pthread_cond_t cond;
+    /* queued asynchronous read, restarted instead of signaled */
+    struct async_read* async;
+    struct track_waiter* next;
+};
 
-        clock_gettime(CLOCK_REALTIME, &timeout);
+/* read queued by spotify_read_async, owned by the queue while waiting */
+struct async_read
+{
+    struct track_waiter waiter;
+    struct spotifs_context* ctx;
+    struct track* track;
+    off_t offset;
+    size_t size;
+    char* buffer;
+    int flags;
+    spotify_read_callback callback;
+    void* data;
+    /* when the read was queued first, 0 if it never waited */
+    uint64_t queued;
+};
+
+/* sleeping reader is signaled, asynchronous one is moved to restart list */
+static void wake_reader(struct track* track, struct track_waiter* waiter, struct track_waiter** restart)
+{
+    if (waiter->async) {
+        track->waiters--;
+        waiter->next = *restart;
+        *restart = waiter;
+    } else {
+        waiter->woken = 1;
+        pthread_cond_signal(&waiter->cond);
+    }
+}
 
-        //timeout.tv_sec += next_timeout / 1000;
-        //timeout.tv_nsec += (next_timeout % 1000) * 1000000L;
+/*
+ * wake readers whose range is present now. Data was added up to limit, so
+ * readers needing anything behind it are not checked. Asynchronous reads are
+ * put to restart list, they have to be restarted by restart_reads after
+ * locks are released. track->lock must be held.
+ */
+static void wake_readers(struct track* track, off_t limit, struct track_waiter** restart)
+{
+    struct track_waiter** link = &track->waiting;
 
-        timeout.tv_sec ++;
+    while (*link && (*link)->offset + (*link)->size <= limit) {
+        struct track_waiter* waiter = *link;
 
-        if (SP_ERROR_OK != err) {
-            g_error("%s: error: '%s'", __func__, sp_error_message(err));
+        if (buffer_has(&track->buffer, waiter->offset, waiter->size)) {
+            *link = waiter->next;
+            wake_reader(track, waiter, restart);
+        } else {
+            link = &waiter->next;
         }
     }
+}
 
-    return NULL;
+/* track failed, nothing is going to be delivered. track->lock must be held */
+static void wake_all_readers(struct track* track, struct track_waiter** restart)
+{
+    while (track->waiting) {
+        struct track_waiter* waiter = track->waiting;
+
+        track->waiting = waiter->next;
+        wake_reader(track, waiter, restart);
+    }
 }
 
-void sp_cb_playlist_metadata_updated(sp_playlist *pl, void *userdata)
+/* linear streaming delivers byte at missing soon, without seeking. track->lock must be held */
+static int stream_reaches(struct track* track, off_t missing)
 {
+    /* requested seek is going to be done by worker before anything else is streamed */
+    const off_t write_pointer = track->seek_pending ? track->seek_offset : track->buffer.write_pointer;
+
+    return missing >= write_pointer
+        && missing <= write_pointer + wave_size(2, track->channels, track->sample_rate, SEEK_THRESHOLD_MS);
 }
 
-static sp_playlist_callbacks pl_callbacks = {
-    .playlist_metadata_updated = &sp_cb_playlist_metadata_updated
-};
+/* some queued reader is going to get its data from the stream. track->lock must be held */
+static int stream_serves_readers(struct track* track)
+{
+    struct track_waiter* waiter;
+
+    for (waiter = track->waiting; waiter; waiter = waiter->next) {
+        if (stream_reaches(track, waiter->offset + buffer_available(&track->buffer, waiter->offset))) {
+            return 1;
+        }
+    }
 
+    return 0;
+}
 
-static void initialize_playlists(struct spotifs_context* ctx, sp_playlistcontainer *container)
+/*
+ * write pointer jumped away from readers queued before the seek or stream
+ * stopped. When nobody left in the queue is served by the stream, all of
+ * them are woken, so they seek again. Readers behind a running stream wait
+ * until it satisfies the ones it serves, instead of seeking back and forth.
+ * track->lock must be held.
+ */
+static void wake_stranded_readers(struct track* track, struct track_waiter** restart)
 {
-    const int num_playlists = sp_playlistcontainer_num_playlists(container);
-    int i, j;
+    if (track->waiting && !stream_serves_readers(track)) {
+        wake_all_readers(track, restart);
+    }
+}
 
-    struct sfs_entry *library = sfs_get(&g_directory.first, "/library");
+/* asynchronous reads woken by delivery callbacks, restarted by worker thread */
+static struct track_waiter* g_restart_queue = NULL;
+static struct track_waiter** g_restart_tail = &g_restart_queue;
+static pthread_mutex_t g_restart_lock = PTHREAD_MUTEX_INITIALIZER;
 
-    if (!num_playlists || !library) {
+/* hand woken asynchronous reads over to worker, callbacks must not copy and reply themselves */
+static void queue_restarts(struct spotifs_context* ctx, struct track_waiter* restart)
+{
+    if (!restart) {
         return;
     }
 
-    for (i = 0; i < num_playlists; i++) {
-        struct sfs_entry *entry, *track_entry;
-        struct playlist *playlist = malloc(sizeof(struct playlist));
-        char *name;
-        int num_songs;
-        playlist->sp_playlist = sp_playlistcontainer_playlist (container, i);
-        sp_playlist_add_callbacks(playlist->sp_playlist, &pl_callbacks, playlist);
-
-        name = replace_character(strdup(sp_playlist_name(playlist->sp_playlist)), '/', '_');
+    pthread_mutex_lock(&g_restart_lock);
 
-        entry = sfs_add_child(library, name, sfs_directory | sfs_playlist);
-        entry->playlist = playlist;
+    *g_restart_tail = restart;
 
-        free(name);
+    while (*g_restart_tail) {
+        g_restart_tail = &(*g_restart_tail)->next;
+    }
 
-        /* create song list for playlist */
-        num_songs = sp_playlist_num_tracks(playlist->sp_playlist);
+    pthread_mutex_unlock(&g_restart_lock);
 
-        for (j = 0; j < num_songs; j++) {
-            struct track* track = malloc(sizeof(struct track));
-            memset(track, 0, sizeof(struct track));
-            track->spotify_track = sp_playlist_track(playlist->sp_playlist, j);
-            track->duration = sp_track_duration(track->spotify_track);
+    wake_worker(ctx);
+}
 
-            name = malloc(strlen(sp_track_name(track->spotify_track)) + 5);
-            strcpy(name, sp_track_name(track->spotify_track));
-            strcat(name, ".wav");
-            replace_character(name, '/', '_');
+/* take reads of the track out of worker's queue, they are added to list */
+static void unqueue_restarts(struct track* track, struct track_waiter** list)
+{
+    struct track_waiter** link = &g_restart_queue;
 
-            track_entry = sfs_add_child(entry, name, sfs_track);
-            track_entry->track = track;
+    pthread_mutex_lock(&g_restart_lock);
 
-            track_entry->size = wave_size(2, 2, 44100, track->duration) + wave_header_size();
+    while (*link) {
+        struct track_waiter* waiter = *link;
 
-            free(name);
+        if (waiter->async->track == track) {
+            *link = waiter->next;
+            waiter->next = *list;
+            *list = waiter;
+        } else {
+            link = &waiter->next;
         }
     }
+
+    g_restart_tail = link;
+
+    pthread_mutex_unlock(&g_restart_lock);
 }
 
-static void sp_cb_container_loaded(sp_playlistcontainer *container, void *userdata)
+static void restart_reads(struct track_waiter* restart);
+static void fail_reads(struct track_waiter* failed, int error);
+static void materialize_requested(struct spotifs_context* ctx);
+
+/*
+ * publish extent containing the last written byte, so readers can copy data
+ * inside it without locking. track->lock must be held.
+ */
+static void publish_extent(struct track* track)
 {
-    struct spotifs_context* ctx = userdata;
+    struct buffer_extent extent = {0, 0};
+    const unsigned int seq = track->published_seq;
 
-    g_debug("%s", __func__);
+    if (buffer_is_initialized(&track->buffer) && track->buffer.write_pointer) {
+        buffer_extent_at(&track->buffer, track->buffer.write_pointer - 1, &extent);
+    }
 
-    /* container was loaded, refresh playlists */
-    pthread_mutex_lock(&g_directory.lock);
-    initialize_playlists(ctx, container);
-    pthread_mutex_unlock(&g_directory.lock);
+    __atomic_store_n(&track->published_seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    __atomic_store_n(&track->published_start, extent.start, __ATOMIC_RELAXED);
+    __atomic_store_n(&track->published_end, extent.end, __ATOMIC_RELAXED);
+
+    __atomic_store_n(&track->published_seq, seq + 2, __ATOMIC_RELEASE);
 }
 
-static sp_playlistcontainer_callbacks pc_callbacks = {
-    .container_loaded = &sp_cb_container_loaded,
-};
+static int published_has(struct track* track, off_t offset, size_t size)
+{
+    unsigned int seq;
+    off_t start, end;
 
-static void sp_cb_offline_status_updated(sp_session *session)
+    do {
+        seq = __atomic_load_n(&track->published_seq, __ATOMIC_ACQUIRE);
+        start = __atomic_load_n(&track->published_start, __ATOMIC_RELAXED);
+        end = __atomic_load_n(&track->published_end, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((seq & 1) || seq != __atomic_load_n(&track->published_seq, __ATOMIC_RELAXED));
+
+    return start <= offset && offset + size <= end;
+}
+
+/* current_track_mutex must be held by all the player functions below */
+static void player_started()
 {
-    g_debug("%s: new status: %d", __func__, sp_session_connectionstate(session));
+    if (!g_playing_since) {
+        g_playing_since = stats_clock();
+        g_playing_delivered = 0;
+    }
 }
 
-static void sp_cb_connectionstate_updated(sp_session* session)
+static void player_stopped()
 {
-    g_debug("%s: new status: %d", __func__, sp_session_connectionstate(session));
+    if (g_playing_since) {
+        stats_add(STATS_PLAYER_NS, stats_clock() - g_playing_since);
+        g_playing_since = 0;
+    }
 }
 
-// handle logged in event
-static void sp_cb_logged_in(sp_session *sess, sp_error error)
+/* player API is used only by worker thread */
+static void unload_player(struct spotifs_context* ctx)
 {
-    struct spotifs_context* ctx = sp_session_userdata(sess);
+    g_debug("%s", __func__);
 
-    assert(ctx != NULL);
-    assert(ctx->spotify_session == sess);
+    player_stopped();
 
-    pthread_mutex_lock(&ctx->lock);
+    sp_session_player_play(ctx->spotify_session, 0);
+    sp_session_player_unload(ctx->spotify_session);
+    g_current_track = NULL;
+    g_player_loaded = 0;
+}
 
-    if (SP_ERROR_OK != error) {
-        ctx->logged_in = -1;
-        g_error("%s: got error: '%s'", __func__, sp_error_message(error));
+static void load_player(struct spotifs_context* ctx, struct track* track)
+{
+    sp_error err;
+
+    g_debug("%s: write pointer: %zu", __func__, track->buffer.write_pointer);
+
+    if (g_player_loaded) {
+        unload_player(ctx);
     }
-    else
-    {
-        ctx->logged_in = 1;
-        g_debug("%s: logged in", __func__);
+
+    err = sp_session_player_load(ctx->spotify_session, track->spotify_track);
+
+    /* readers keep waiting, load is retried by scheduler */
+    if (SP_ERROR_IS_LOADING == err) {
+        g_debug("%s: track is loading", __func__);
+        track->loading = 1;
+        clock_gettime(CLOCK_MONOTONIC, &track->loading_since);
+        return;
     }
 
-    // signal that login is completed
-    pthread_cond_signal(&ctx->change);
-    pthread_mutex_unlock(&ctx->lock);
+    track->loading = 0;
 
-    ctx->spotify_playlist_container = sp_session_playlistcontainer(ctx->spotify_session);
+    if (SP_ERROR_OK != err) {
+        struct track_waiter* restart = NULL;
 
-    if (sp_playlistcontainer_is_loaded(ctx->spotify_playlist_container)) {
-        sp_cb_container_loaded(ctx->spotify_playlist_container, ctx);
-    } else {
-        sp_playlistcontainer_add_callbacks(ctx->spotify_playlist_container, &pc_callbacks, ctx);
+        g_warning("%s: sp_session_player_load: %s", __func__, sp_error_message(err));
+        pthread_mutex_lock(&track->lock);
+        track->error = 1;
+        wake_all_readers(track, &restart);
+        pthread_mutex_unlock(&track->lock);
+
+        /* failed reads are replied by worker after scheduling */
+        queue_restarts(ctx, restart);
+        return;
     }
 
-    g_debug("%s: exit", __func__);
-}
+    g_player_loaded = 1;
 
-static void sp_cb_logged_out(sp_session *sess)
-{
-    struct spotifs_context* ctx = sp_session_userdata(sess);
-    g_debug("%s: logged out", __func__);
+    pthread_mutex_lock(&track->lock);
 
-    pthread_mutex_lock(&ctx->lock);
+    /* continue from the place where previous time slice ended or where readers requested */
+    if (buffer_is_initialized(&track->buffer) && track->buffer.write_pointer) {
+        const int ms = wave_offset_to_ms(2, track->channels, track->sample_rate, track->buffer.write_pointer);
 
-    /* notify worker thread to exit */
-    ctx->spotify_event = 1;
-    ctx->worker_running = 0;
+        if (SP_ERROR_OK == sp_session_player_seek(ctx->spotify_session, ms)) {
+            buffer_seek(&track->buffer, wave_ms_to_offset(2, track->channels, track->sample_rate, ms));
+        } else {
+            buffer_seek(&track->buffer, 0);
+        }
+    }
 
-    pthread_cond_signal(&ctx->change);
-    pthread_mutex_unlock(&ctx->lock);
+    pthread_mutex_unlock(&track->lock);
+
+    if (SP_ERROR_OK != (err = sp_session_player_play(ctx->spotify_session, 1))) {
+        g_warning("%s: sp_session_player_play: %s", __func__, sp_error_message(err));
+    } else {
+        player_started();
+    }
+
+    g_current_track = track;
+    clock_gettime(CLOCK_MONOTONIC, &g_current_track_since);
 }
 
-static void sp_cb_notify_main_thread(sp_session *session)
+/*
+ * restart streaming of current track from given PCM offset, called by worker
+ * thread. current_track_mutex and track->lock must be held.
+ */
+static void seek_current_track(struct spotifs_context* ctx, off_t offset)
 {
-    struct spotifs_context* ctx = sp_session_userdata(session);
+    struct track* track = g_current_track;
+    const int ms = wave_offset_to_ms(2, track->channels, track->sample_rate, offset);
+    sp_error err;
 
-    pthread_mutex_lock(&ctx->lock);
-    ctx->spotify_event = 1;
-    pthread_cond_signal(&ctx->change);
-    pthread_mutex_unlock(&ctx->lock);
+    g_debug("%s: offset: %zu, ms: %d, write pointer: %zu", __func__, offset, ms, track->buffer.write_pointer);
+
+    if (SP_ERROR_OK != (err = sp_session_player_seek(ctx->spotify_session, ms))) {
+        g_warning("%s: sp_session_player_seek: %s", __func__, sp_error_message(err));
+        return;
+    }
+
+    /* new data will be delivered starting from frame matching ms */
+    buffer_seek(&track->buffer, wave_ms_to_offset(2, track->channels, track->sample_rate, ms));
+
+    /* player could be paused by end_of_track */
+    sp_session_player_play(ctx->spotify_session, 1);
+    player_started();
 }
 
-static int sp_cb_music_delivery(sp_session *session, const sp_audioformat *format, const void *frames, int num_frames)
+/*
+ * hand the player over to next track in round robin fashion, called by worker
+ * thread. Returns milliseconds left in the time slice of current track or -1
+ * if player is idle.
+ */
+static int schedule_player(struct spotifs_context* ctx)
 {
+    struct track *candidate, *next = NULL, *fallback = NULL;
+    long elapsed;
+    int left = -1;
+
     pthread_mutex_lock(&current_track_mutex);
 
-    if (!g_current_track) {
+    if (g_current_track && track_wants_player(g_current_track)
+        && (elapsed = elapsed_ms(&g_current_track_since)) < PLAYER_TIME_SLICE_MS) {
         pthread_mutex_unlock(&current_track_mutex);
-        return num_frames;
+        return PLAYER_TIME_SLICE_MS - elapsed;
     }
 
-    if (!g_current_track->buffer.data)
-    {
-        g_current_track->buffer.capacity = wave_size(2, format->channels, format->sample_rate, g_current_track->duration);
-        g_current_track->buffer.pointer = 0;
-        g_current_track->buffer.data = malloc(g_current_track->buffer.capacity);
+    /* start after current track, so current one is checked last. Tracks
+     * with waiting readers are preferred over buffering ahead. */
+    candidate = g_current_track ? g_current_track->next_open : NULL;
 
-        g_current_track->size = g_current_track->buffer.capacity + wave_header_size();
-        g_current_track->sample_rate = format->sample_rate;
-        g_current_track->channels = format->channels;
+    do {
+        if (!candidate) {
+            candidate = g_open_tracks;
 
-        g_debug("%s: allocating buffer: channels: %d, sample rate: %d, duration: %d, size: %zu",
-            __func__, format->channels, format->sample_rate, g_current_track->duration, g_current_track->buffer.capacity);
-    }
+            if (!candidate) {
+                break;
+            }
+        }
 
-    /* assume that these values can't change */
-    assert(g_current_track->sample_rate == format->sample_rate);
-    assert(g_current_track->channels == format->channels);
+        if (track_wants_player(candidate)) {
+            if (candidate->waiters) {
+                next = candidate;
+                break;
+            } else if (!fallback) {
+                fallback = candidate;
+            }
+        }
 
-    size_t data_bytes = num_frames * 2 * format->channels;
-    const size_t space_left = g_current_track->buffer.capacity - g_current_track->buffer.pointer;
+        if (candidate == g_current_track) {
+            break;
+        }
+
+        candidate = candidate->next_open;
+    } while (g_current_track || candidate);
+
+    if (!next) {
+        next = fallback;
+    }
 
-    if (data_bytes > space_left) {
-        g_warning("%s: write beyound the buffer, space left: %zubytes, data: %zubytes", __func__, space_left, data_bytes);
-        data_bytes = space_left;
+    if (next == g_current_track) {
+        /* nobody else needs the player, start new time slice */
+        clock_gettime(CLOCK_MONOTONIC, &g_current_track_since);
+    } else if (next) {
+        load_player(ctx, next);
+    } else if (g_player_loaded) {
+        unload_player(ctx);
     }
 
-    memcpy(g_current_track->buffer.data + g_current_track->buffer.pointer, frames, data_bytes);
-    g_current_track->buffer.pointer += data_bytes;
+    if (g_current_track) {
+        left = PLAYER_TIME_SLICE_MS;
+    }
 
-    pthread_cond_signal(&current_track_cond);
     pthread_mutex_unlock(&current_track_mutex);
 
-    return num_frames;
+    return left;
 }
 
-static void sp_cb_connection_error(sp_session *session, sp_error error)
+void spotify_set_prefetch_threshold(int percent)
 {
-    g_warning("%s: %s", __func__, sp_error_message(error));
+    g_prefetch_threshold = percent;
 }
 
-static void sp_cb_play_token_lost(sp_session *session)
+void spotify_set_short_reads(int enabled)
 {
-    g_info("%s: Play token lost", __func__);
+    g_short_reads = enabled;
 }
 
-static void sp_cb_log_message(sp_session *session, const char *data)
+void spotify_set_max_wait(int ms)
 {
+    g_max_wait_ms = ms;
 }
 
-static void sp_cb_end_of_track(sp_session *session)
+int spotify_partial_reads()
 {
-    struct spotifs_context *ctx = sp_session_userdata(session);
+    return g_short_reads || g_max_wait_ms;
+}
 
-    pthread_mutex_lock(&current_track_mutex);
-    /* mark buffer as full & stop buffering */
-    g_current_track->buffer.pointer = g_current_track->buffer.capacity;
-    sp_session_player_play(ctx->spotify_session, 0);
-    pthread_mutex_unlock(&current_track_mutex);
+/*
+ * buffering of prefetched tracks is started and stopped by prefetcher
+ * thread, so worker never waits for the cache
+ */
+struct prefetch_job
+{
+    struct spotifs_context* ctx;
+    struct track* track;
+    /* drop the reference of prefetching instead of starting buffering */
+    int release;
+    struct prefetch_job* next;
+};
 
-    g_debug("End of track");
+static struct prefetch_job* g_prefetch_jobs = NULL;
+static struct prefetch_job** g_prefetch_jobs_tail = &g_prefetch_jobs;
+static int g_prefetcher_running = 0;
+static pthread_t g_prefetcher;
+static pthread_mutex_t g_prefetch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_prefetch_cond = PTHREAD_COND_INITIALIZER;
 
+static void run_prefetch_job(struct prefetch_job* job)
+{
+    if (job->release) {
+        spotify_release_track(job->ctx, job->track);
+    } else {
+        spotify_buffer_track(job->ctx, job->track);
+    }
 }
 
-static void streaming_error(sp_session *session, sp_error error)
+static void queue_prefetch_job(struct spotifs_context* ctx, struct track* track, int release)
 {
-    g_error("%s: %s", __func__, sp_error_message(error));
-}
+    struct prefetch_job* job = malloc(sizeof(struct prefetch_job));
 
-static sp_session_callbacks session_callbacks = {
-    .logged_in = &sp_cb_logged_in,
-    .logged_out = &sp_cb_logged_out,
-    .notify_main_thread = &sp_cb_notify_main_thread,
-    .music_delivery = &sp_cb_music_delivery,
-    .connection_error = &sp_cb_connection_error,
-    .play_token_lost = &sp_cb_play_token_lost,
-    .log_message = &sp_cb_log_message,
-    .end_of_track = &sp_cb_end_of_track,
-    .streaming_error = &streaming_error,
-    .offline_status_updated = &sp_cb_offline_status_updated,
-    .connectionstate_updated = &sp_cb_connectionstate_updated,
-    NULL,
-};
+    if (!job) {
+        struct prefetch_job local = { ctx, track, release, NULL };
 
-static sp_session_config spconfig = {
-    .api_version = SPOTIFY_API_VERSION,
-    .cache_location = "tmp",
-    .settings_location = "tmp",
-    .application_key = g_appkey,
-    .application_key_size = 0,
-    .user_agent = "spotify-fs-example",
+        /* reference must not leak, worker does the job itself */
+        run_prefetch_job(&local);
+        return;
+    }
+
+    job->ctx = ctx;
+    job->track = track;
+    job->release = release;
+    job->next = NULL;
+
+    pthread_mutex_lock(&g_prefetch_lock);
+
+    *g_prefetch_jobs_tail = job;
+    g_prefetch_jobs_tail = &job->next;
+
+    pthread_cond_signal(&g_prefetch_cond);
+    pthread_mutex_unlock(&g_prefetch_lock);
+}
+
+static void* prefetcher_thread(void* arg)
+{
+    struct prefetch_job* job;
+
+    pthread_mutex_lock(&g_prefetch_lock);
+
+    while (g_prefetcher_running || g_prefetch_jobs) {
+        if (!(job = g_prefetch_jobs)) {
+            pthread_cond_wait(&g_prefetch_cond, &g_prefetch_lock);
+            continue;
+        }
+
+        if (!(g_prefetch_jobs = job->next)) {
+            g_prefetch_jobs_tail = &g_prefetch_jobs;
+        }
+
+        pthread_mutex_unlock(&g_prefetch_lock);
+
+        run_prefetch_job(job);
+        free(job);
+
+        pthread_mutex_lock(&g_prefetch_lock);
+    }
+
+    pthread_mutex_unlock(&g_prefetch_lock);
+
+    return NULL;
+}
+
+static int start_prefetcher()
+{
+    g_prefetcher_running = 1;
+
+    if (pthread_create(&g_prefetcher, NULL, prefetcher_thread, NULL)) {
+        g_prefetcher_running = 0;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* queued jobs are finished first */
+static void stop_prefetcher()
+{
+    pthread_mutex_lock(&g_prefetch_lock);
+    g_prefetcher_running = 0;
+    pthread_cond_signal(&g_prefetch_cond);
+    pthread_mutex_unlock(&g_prefetch_lock);
+
+    pthread_join(g_prefetcher, NULL);
+}
+
+/* drop the track opened by prefetching, called after worker and prefetcher stopped */
+static void release_prefetched_track(struct spotifs_context* ctx)
+{
+    struct track* track = g_prefetched_track;
+
+    if (!track) {
+        return;
+    }
+
+    pthread_mutex_lock(&current_track_mutex);
+    g_prefetched_track = NULL;
+    pthread_mutex_unlock(&current_track_mutex);
+
+    spotify_release_track(ctx, track);
+}
+
+/*
+ * let libspotify prefetch the track following the one which crossed the
+ * threshold and start decoding its beginning, so opening it next doesn't
+ * wait for the player. Called by worker thread, the directory is locked
+ * only to take the reference, cache is read by prefetcher thread.
+ */
+static void prefetch_next_track(struct spotifs_context* ctx)
+{
+    struct track *track, *next = NULL, *previous = NULL;
+    struct sfs_entry* entry;
+
+    pthread_mutex_lock(&current_track_mutex);
+    track = g_prefetch_request;
+    g_prefetch_request = NULL;
+    pthread_mutex_unlock(&current_track_mutex);
+
+    if (!track) {
+        return;
+    }
+
+    pthread_rwlock_wrlock(&g_directory.lock);
+
+    /* entry could be removed from the playlist in the meantime */
+    if (track->entry && track->entry->parent
+        && (entry = track->entry->next) && (entry->type & sfs_track)
+        && entry->track != g_prefetched_track) {
+        g_debug("%s: %s", __func__, entry->name);
+
+        next = entry->track;
+        sp_session_player_prefetch(ctx->spotify_session, next->spotify_track);
+        __atomic_add_fetch(&next->refs, 1, __ATOMIC_RELAXED);
+
+        pthread_mutex_lock(&current_track_mutex);
+        previous = g_prefetched_track;
+        g_prefetched_track = next;
+        pthread_mutex_unlock(&current_track_mutex);
+    }
+
+    pthread_rwlock_unlock(&g_directory.lock);
+
+    if (next) {
+        queue_prefetch_job(ctx, next, 0);
+    }
+
+    if (previous) {
+        queue_prefetch_job(ctx, previous, 1);
+    }
+}
+
+/* seek tracks as requested by readers, called by worker thread */
+static void apply_seeks(struct spotifs_context* ctx)
+{
+    struct track* track;
+
+    pthread_mutex_lock(&current_track_mutex);
+
+    for (track = g_open_tracks; track; track = track->next_open) {
+        pthread_mutex_lock(&track->lock);
+
+        if (track->seek_pending) {
+            track->seek_pending = 0;
+
+            if (track == g_current_track) {
+                seek_current_track(ctx, track->seek_offset);
+            } else {
+                /* player will be seeked there when track gets it */
+                buffer_seek(&track->buffer, track->seek_offset);
+            }
+        }
+
+        pthread_mutex_unlock(&track->lock);
+    }
+
+    pthread_mutex_unlock(&current_track_mutex);
+}
+
+/* copy and reply asynchronous reads woken since last time, called by worker thread */
+static void restart_queued_reads()
+{
+    struct track_waiter* restart;
+
+    pthread_mutex_lock(&g_restart_lock);
+    restart = g_restart_queue;
+    g_restart_queue = NULL;
+    g_restart_tail = &g_restart_queue;
+    pthread_mutex_unlock(&g_restart_lock);
+
+    restart_reads(restart);
+}
+
+/* keep spotify track alive while its track is open, also when it's removed from playlist. Worker only. */
+static void reference_track(struct track* track)
+{
+    if (!track->spotify_ref) {
+        sp_track_add_ref(track->spotify_track);
+        track->spotify_ref = 1;
+    }
+}
+
+static void reference_open_tracks()
+{
+    struct track* track;
+
+    pthread_mutex_lock(&current_track_mutex);
+
+    for (track = g_open_tracks; track; track = track->next_open) {
+        reference_track(track);
+    }
+
+    pthread_mutex_unlock(&current_track_mutex);
+}
+
+static void unpin_track(struct track* track);
+
+/*
+ * drop references of stopped tracks and the pins their release handed
+ * over, called by worker. Tracks opened again get the reference back from
+ * reference_open_tracks.
+ */
+static void release_stopped_tracks()
+{
+    struct track *track, *stopped;
+
+    pthread_mutex_lock(&current_track_mutex);
+    stopped = g_stopped_tracks;
+    g_stopped_tracks = NULL;
+    pthread_mutex_unlock(&current_track_mutex);
+
+    for (track = stopped; track; track = track->next_stopped) {
+        if (track->spotify_ref) {
+            sp_track_release(track->spotify_track);
+            track->spotify_ref = 0;
+        }
+    }
+
+    pthread_rwlock_wrlock(&g_directory.lock);
+
+    while ((track = stopped)) {
+        stopped = track->next_stopped;
+
+        pthread_mutex_lock(&current_track_mutex);
+        track->stop_queued = 0;
+        track->next_stopped = NULL;
+        pthread_mutex_unlock(&current_track_mutex);
+
+        unpin_track(track);
+    }
+
+    pthread_rwlock_unlock(&g_directory.lock);
+}
+
+/* bucket i counts samples shorter than 2^i microseconds, last one everything longer */
+#define LATENCY_BUCKETS 24
+
+/* duration of sp_session_process_events calls */
+static unsigned long g_process_latency[LATENCY_BUCKETS];
+/* how late worker woke up after the deadline requested by libspotify */
+static unsigned long g_wakeup_latency[LATENCY_BUCKETS];
+
+static void record_latency(unsigned long* histogram, long us)
+{
+    int bucket = 0;
+
+    while (bucket < LATENCY_BUCKETS - 1 && us >= (1L << bucket)) {
+        bucket++;
+    }
+
+    histogram[bucket]++;
+}
+
+static void log_latency(const char* name, const unsigned long* histogram)
+{
+    int i;
+
+    for (i = 0; i < LATENCY_BUCKETS; i++) {
+        if (histogram[i]) {
+            g_info("%s latency < %ldus: %lu", name, 1L << i, histogram[i]);
+        }
+    }
+}
+
+static void* spotify_worker_thread(void *param)
+{
+    struct spotifs_context* ctx = param;
+    struct timespec deadline, started;
+
+    int next_timeout = 0, slice, timedout;
+    sp_error err;
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+
+    while (ctx->worker_running)
+    {
+        timedout = 0;
+
+        pthread_mutex_lock(&ctx->lock);
+
+        /* notifications which came while processing events are handled at
+         * once, all of them in a single pass */
+        while (!ctx->spotify_event) {
+            if (pthread_cond_timedwait(&ctx->change, &ctx->lock, &deadline) == ETIMEDOUT) {
+                timedout = 1;
+                break;
+            }
+        }
+
+        ctx->spotify_event = 0;
+
+        pthread_mutex_unlock(&ctx->lock);
+
+        if (timedout) {
+            record_latency(g_wakeup_latency, elapsed_us(&deadline));
+        }
+
+        do {
+            clock_gettime(CLOCK_MONOTONIC, &started);
+            err = sp_session_process_events(ctx->spotify_session, &next_timeout);
+            record_latency(g_process_latency, elapsed_us(&started));
+        } while(next_timeout == 0 && err == SP_ERROR_OK);
+
+        if (SP_ERROR_OK != err) {
+            g_error("%s: error: '%s'", __func__, sp_error_message(err));
+        }
+
+        materialize_requested(ctx);
+
+        release_stopped_tracks();
+        reference_open_tracks();
+
+        apply_seeks(ctx);
+
+        /* wake up also when the time slice of current track ends */
+        if ((slice = schedule_player(ctx)) >= 0 && slice < next_timeout) {
+            next_timeout = slice;
+        }
+
+        restart_queued_reads();
+        prefetch_next_track(ctx);
+
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        timespec_add_ms(&deadline, next_timeout);
+    }
+
+    log_latency("event processing", g_process_latency);
+    log_latency("wakeup", g_wakeup_latency);
+
+    return NULL;
+}
+
+/* defined below, together with the callbacks */
+static sp_playlist_callbacks pl_callbacks;
+
+/* container changes are ignored until the whole library is initialized */
+static int g_container_loaded = 0;
+
+/* counts playlists which were loaded or removed, waiting lookups are signaled on change */
+static unsigned long g_playlist_loads = 0;
+static pthread_mutex_t g_playlist_load_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_playlist_load_cond = PTHREAD_COND_INITIALIZER;
+
+/* some playlist was requested to be materialized by a lookup */
+static int g_materialize_pending = 0;
+
+/* how long the first listing of a playlist waits for libspotify to load it */
+#define PLAYLIST_LOAD_TIMEOUT_MS 5000
+
+/* file name of a track, "/" can't be used in names */
+static void track_file_name(sp_track* track, char* name)
+{
+    snprintf(name, NAME_MAX + 1, "%.*s.wav", NAME_MAX - 4, sp_track_name(track));
+    replace_character(name, '/', '_');
+}
+
+/* track is referenced or its buffering is being stopped, directory lock must be held */
+static int track_is_open(struct track* track)
+{
+    return track->refs || track->stopping;
+}
+
+/* spotify URI of the track kept in the arena, NULL if it can't be created */
+static char* track_link(struct arena* arena, sp_track* spotify_track)
+{
+    sp_link* link = sp_link_create_from_track(spotify_track, 0);
+    char uri[128] = {0};
+
+    if (!link) {
+        return NULL;
+    }
+
+    sp_link_as_string(link, uri, sizeof(uri));
+    sp_link_release(link);
+
+    return arena_strdup(arena, uri);
+}
+
+static void free_retired_arena(struct retired_arena* retired)
+{
+    struct retired_arena** link;
+
+    for (link = &g_retired_arenas; *link != retired; link = &(*link)->next);
+
+    *link = retired->next;
+    arena_release(&retired->arena);
+    free(retired);
+}
+
+/* drop the pin of stopped track, directory write lock must be held */
+static void unpin_track(struct track* track)
+{
+    struct retired_arena* retired = track->retired;
+
+    track->stopping--;
+
+    /* track isn't touched after this, its memory goes with the last open track of the arena */
+    if (retired && !track_is_open(track) && !--retired->open) {
+        g_debug("%s: releasing retired playlist", __func__);
+        free_retired_arena(retired);
+    }
+}
+
+static void retire_track(struct retired_arena* retired, struct track* track)
+{
+    /* playlist doesn't hold the track anymore */
+    reference_track(track);
+
+    if (retired) {
+        track->retired = retired;
+        retired->open++;
+    }
+}
+
+/* drop track entries of the playlist, memory of open tracks is kept until they are closed */
+static void release_playlist_tracks(struct sfs_entry* entry)
+{
+    struct playlist* playlist = entry->playlist;
+    struct retired_arena* retired = NULL;
+    struct track* track;
+    int open = 0;
+    size_t i;
+
+    for (i = 0; i < entry->num_children; i++) {
+        open += track_is_open(entry->child_array[i]->track);
+    }
+
+    for (track = playlist->removed; track; track = track->next_removed) {
+        open += track_is_open(track);
+    }
+
+    if (open && !(retired = malloc(sizeof(struct retired_arena)))) {
+        g_warning("%s: can't allocate retired arena, kept until disconnect", __func__);
+    }
+
+    for (i = 0; open && i < entry->num_children; i++) {
+        if (track_is_open(entry->child_array[i]->track)) {
+            retire_track(retired, entry->child_array[i]->track);
+        }
+    }
+
+    for (track = playlist->removed; open && track; track = track->next_removed) {
+        if (track_is_open(track)) {
+            retire_track(retired, track);
+        }
+    }
+
+    sfs_remove_children(entry);
+
+    if (retired) {
+        arena_init(&retired->arena, playlist->arena.block_size);
+        arena_move(&retired->arena, &playlist->arena);
+        retired->open = open;
+        retired->next = g_retired_arenas;
+        g_retired_arenas = retired;
+    } else if (open) {
+        arena_move(&g_retired_arena, &playlist->arena);
+    } else {
+        arena_release(&playlist->arena);
+    }
+
+    playlist->removed = NULL;
+}
+
+static struct sfs_entry* add_track_entry(struct sfs_entry* entry, sp_track* spotify_track, int position)
+{
+    struct playlist* playlist = entry->playlist;
+    struct track* track = arena_alloc(&playlist->arena, sizeof(struct track));
+    struct sfs_entry* track_entry;
+    char name[NAME_MAX + 1];
+
+    track_file_name(spotify_track, name);
+
+    if (!track || !(track_entry = sfs_new_entry(&playlist->arena, name, sfs_track))) {
+        g_warning("%s: can't allocate entry of %s", __func__, name);
+        return NULL;
+    }
+
+    memset(track, 0, sizeof(struct track));
+    pthread_mutex_init(&track->lock, NULL);
+    pthread_mutex_init(&track->open_lock, NULL);
+    track->cache_fd = -1;
+    track->spotify_track = spotify_track;
+    track->duration = sp_track_duration(track->spotify_track);
+    track->link = track_link(&playlist->arena, spotify_track);
+
+    track_entry->track = track;
+    track->entry = track_entry;
+    track_entry->size = wave_size(2, 2, 44100, track->duration) + wave_header_size();
+
+    return sfs_insert_child_entry(entry, track_entry, position);
+}
+
+static void build_playlist_tracks(struct sfs_entry* entry)
+{
+    struct playlist* playlist = entry->playlist;
+    const int num_songs = sp_playlist_num_tracks(playlist->sp_playlist);
+    int j;
+
+    for (j = 0; j < num_songs; j++) {
+        add_track_entry(entry, sp_playlist_track(playlist->sp_playlist, j), j);
+    }
+}
+
+static void rebuild_playlist_tracks(struct sfs_entry* entry)
+{
+    g_debug("%s: %s", __func__, entry->name);
+
+    release_playlist_tracks(entry);
+    build_playlist_tracks(entry);
+}
+
+static void playlist_directory_name(sp_playlist* spotify_playlist, char* name)
+{
+    snprintf(name, NAME_MAX + 1, "%s", sp_playlist_name(spotify_playlist));
+    replace_character(name, '/', '_');
+}
+
+static struct sfs_entry* add_playlist_entry(struct sfs_entry* library, sp_playlist* spotify_playlist, int position)
+{
+    struct playlist *playlist = arena_alloc(&g_playlists_arena, sizeof(struct playlist));
+    struct sfs_entry *entry;
+    char name[NAME_MAX + 1];
+
+    playlist_directory_name(spotify_playlist, name);
+
+    if (!playlist || !(entry = sfs_new_entry(&g_playlists_arena, name, sfs_directory | sfs_playlist))) {
+        g_warning("%s: can't allocate entry of %s", __func__, name);
+        return NULL;
+    }
+
+    memset(playlist, 0, sizeof(struct playlist));
+    playlist->sp_playlist = spotify_playlist;
+    arena_init(&playlist->arena, 64 * 1024);
+
+    entry->playlist = playlist;
+    playlist->entry = entry;
+    sfs_insert_child_entry(library, entry, position);
+
+    sp_playlist_add_callbacks(playlist->sp_playlist, &pl_callbacks, playlist);
+
+    /* song list is created on first access, see materialize_playlist */
+    return entry;
+}
+
+static void remove_playlist_entry(struct sfs_entry* library, int position)
+{
+    struct sfs_entry* entry = sfs_get_child_by_index(library, position);
+
+    if (!entry) {
+        return;
+    }
+
+    sp_playlist_remove_callbacks(entry->playlist->sp_playlist, &pl_callbacks, entry->playlist);
+    release_playlist_tracks(entry);
+
+    /* entry itself is in playlists arena */
+    sfs_free_entry(sfs_remove_child_at(library, position));
+}
+
+static void release_playlists(struct sfs_entry* library)
+{
+    struct sfs_entry* entry;
+
+    for (entry = library->children; entry; entry = entry->next) {
+        sp_playlist_remove_callbacks(entry->playlist->sp_playlist, &pl_callbacks, entry->playlist);
+        release_playlist_tracks(entry);
+    }
+
+    sfs_remove_children(library);
+    arena_release(&g_playlists_arena);
+}
+
+static void initialize_playlists(struct spotifs_context* ctx, sp_playlistcontainer *container)
+{
+    const int num_playlists = sp_playlistcontainer_num_playlists(container);
+    int i;
+
+    struct sfs_entry *library = sfs_get(&g_directory.first, "/library");
+
+    if (!library) {
+        return;
+    }
+
+    /* container could be loaded again, start from scratch */
+    release_playlists(library);
+
+    for (i = 0; i < num_playlists; i++) {
+        add_playlist_entry(library, sp_playlistcontainer_playlist(container, i), i);
+    }
+}
+
+/* sfs tree checked against libspotify after incremental update, rebuilt if they differ */
+static void verify_playlist_tracks(struct sfs_entry* entry)
+{
+    sp_playlist* spotify_playlist = entry->playlist->sp_playlist;
+    size_t i;
+
+    if (!entry->playlist->materialized) {
+        return;
+    }
+
+    if (entry->num_children == sp_playlist_num_tracks(spotify_playlist)) {
+        for (i = 0; i < entry->num_children; i++) {
+            if (entry->child_array[i]->track->spotify_track != sp_playlist_track(spotify_playlist, i)) {
+                break;
+            }
+        }
+
+        if (i == entry->num_children) {
+            return;
+        }
+    }
+
+    rebuild_playlist_tracks(entry);
+}
+
+static int compare_positions(const void* a, const void* b)
+{
+    return *(const int*)a - *(const int*)b;
+}
+
+/* copy of positions sorted in ascending order */
+static int* sorted_positions(const int* positions, int count)
+{
+    int* sorted = malloc(count * sizeof(int));
+
+    if (sorted) {
+        memcpy(sorted, positions, count * sizeof(int));
+        qsort(sorted, count, sizeof(int), compare_positions);
+    }
+
+    return sorted;
+}
+
+static void sp_cb_tracks_added(sp_playlist *pl, sp_track * const *tracks, int num_tracks, int position, void *userdata)
+{
+    struct playlist* playlist = userdata;
+    int i;
+
+    g_debug("%s: %d tracks at %d", __func__, num_tracks, position);
+
+    pthread_rwlock_wrlock(&g_directory.lock);
+
+    for (i = 0; playlist->materialized && i < num_tracks; i++) {
+        add_track_entry(playlist->entry, tracks[i], position + i);
+    }
+
+    verify_playlist_tracks(playlist->entry);
+
+    pthread_rwlock_unlock(&g_directory.lock);
+}
+
+static void sp_cb_tracks_removed(sp_playlist *pl, const int *tracks, int num_tracks, void *userdata)
+{
+    struct playlist* playlist = userdata;
+    int* sorted = sorted_positions(tracks, num_tracks);
+    int i;
+
+    g_debug("%s: %d tracks", __func__, num_tracks);
+
+    pthread_rwlock_wrlock(&g_directory.lock);
+
+    /* from the last one, so positions of the rest don't change */
+    for (i = num_tracks - 1; sorted && playlist->materialized && i >= 0; i--) {
+        struct sfs_entry* entry = sfs_remove_child_at(playlist->entry, sorted[i]);
+
+        if (entry) {
+            /* track can be still read through open file handle */
+            if (track_is_open(entry->track)) {
+                reference_track(entry->track);
+                entry->track->next_removed = playlist->removed;
+                playlist->removed = entry->track;
+            }
+
+            sfs_free_entry(entry);
+        }
+    }
+
+    verify_playlist_tracks(playlist->entry);
+
+    pthread_rwlock_unlock(&g_directory.lock);
+
+    free(sorted);
+}
+
+static void sp_cb_tracks_moved(sp_playlist *pl, const int *tracks, int num_tracks, int new_position, void *userdata)
+{
+    struct playlist* playlist = userdata;
+    struct sfs_entry* entry = playlist->entry;
+    struct sfs_entry** moved = malloc(num_tracks * sizeof(struct sfs_entry*));
+    int* sorted = sorted_positions(tracks, num_tracks);
+    int i, before = 0;
+
+    g_debug("%s: %d tracks to %d", __func__, num_tracks, new_position);
+
+    pthread_rwlock_wrlock(&g_directory.lock);
+
+    if (moved && sorted && playlist->materialized) {
+        /* new_position is given in the list before the move */
+        for (i = 0; i < num_tracks; i++) {
+            moved[i] = sfs_get_child_by_index(entry, sorted[i]);
+            before += sorted[i] < new_position;
+        }
+
+        for (i = num_tracks - 1; i >= 0; i--) {
+            sfs_remove_child_at(entry, sorted[i]);
+        }
+
+        for (i = 0; i < num_tracks; i++) {
+            if (moved[i]) {
+                sfs_insert_child_entry(entry, moved[i], new_position - before + i);
+            }
+        }
+    }
+
+    verify_playlist_tracks(entry);
+
+    pthread_rwlock_unlock(&g_directory.lock);
+
+    free(sorted);
+    free(moved);
+}
+
+static void sp_cb_playlist_renamed(sp_playlist *pl, void *userdata)
+{
+    struct playlist* playlist = userdata;
+    char name[NAME_MAX + 1];
+
+    playlist_directory_name(pl, name);
+    g_debug("%s: %s -> %s", __func__, playlist->entry->name, name);
+
+    pthread_rwlock_wrlock(&g_directory.lock);
+    sfs_rename(playlist->entry, &g_playlists_arena, name);
+    pthread_rwlock_unlock(&g_directory.lock);
+}
+
+/* wake lookups waiting for playlists, called after the tree was changed */
+static void notify_playlist_loads()
+{
+    pthread_mutex_lock(&g_playlist_load_mutex);
+    g_playlist_loads++;
+    pthread_cond_broadcast(&g_playlist_load_cond);
+    pthread_mutex_unlock(&g_playlist_load_mutex);
+}
+
+static void sp_cb_playlist_state_changed(sp_playlist *pl, void *userdata)
+{
+    struct playlist* playlist = userdata;
+
+    /* playlists which were not loaded at the time of the container load
+     * show up empty, fill them when they finish loading */
+    if (sp_playlist_is_loaded(pl)) {
+        pthread_rwlock_wrlock(&g_directory.lock);
+        verify_playlist_tracks(playlist->entry);
+        playlist->loaded = playlist->materialized;
+        pthread_rwlock_unlock(&g_directory.lock);
+
+        notify_playlist_loads();
+    }
+}
+
+void sp_cb_playlist_metadata_updated(sp_playlist *pl, void *userdata)
+{
+}
+
+static sp_playlist_callbacks pl_callbacks = {
+    .tracks_added = &sp_cb_tracks_added,
+    .tracks_removed = &sp_cb_tracks_removed,
+    .tracks_moved = &sp_cb_tracks_moved,
+    .playlist_renamed = &sp_cb_playlist_renamed,
+    .playlist_state_changed = &sp_cb_playlist_state_changed,
+    .playlist_metadata_updated = &sp_cb_playlist_metadata_updated
+};
+
+static void sp_cb_container_loaded(sp_playlistcontainer *container, void *userdata)
+{
+    struct spotifs_context* ctx = userdata;
+
+    g_debug("%s", __func__);
+
+    /* container was loaded, refresh playlists */
+    pthread_rwlock_wrlock(&g_directory.lock);
+    initialize_playlists(ctx, container);
+
+    if (!g_container_loaded) {
+        __atomic_store_n(&g_container_load_ns, stats_clock() - g_login_started - g_login_ns, __ATOMIC_RELAXED);
+    }
+
+    g_container_loaded = 1;
+    pthread_rwlock_unlock(&g_directory.lock);
+
+    /* playlists were replaced, waiting lookups look for them again */
+    notify_playlist_loads();
+}
+
+static void sp_cb_playlist_added(sp_playlistcontainer *pc, sp_playlist *playlist, int position, void *userdata)
+{
+    if (!g_container_loaded) {
+        return;
+    }
+
+    g_debug("%s: at %d", __func__, position);
+
+    pthread_rwlock_wrlock(&g_directory.lock);
+    add_playlist_entry(spotify_get_playlists(), playlist, position);
+    pthread_rwlock_unlock(&g_directory.lock);
+}
+
+static void sp_cb_playlist_removed(sp_playlistcontainer *pc, sp_playlist *playlist, int position, void *userdata)
+{
+    struct sfs_entry* library;
+
+    if (!g_container_loaded) {
+        return;
+    }
+
+    g_debug("%s: at %d", __func__, position);
+
+    pthread_rwlock_wrlock(&g_directory.lock);
+
+    library = spotify_get_playlists();
+
+    if (sfs_get_child_by_index(library, position) && sfs_get_child_by_index(library, position)->playlist->sp_playlist == playlist) {
+        remove_playlist_entry(library, position);
+    } else {
+        g_warning("%s: playlist not found at %d, reloading", __func__, position);
+        initialize_playlists(userdata, pc);
+    }
+
+    pthread_rwlock_unlock(&g_directory.lock);
+
+    /* lookups waiting for the playlist give up */
+    notify_playlist_loads();
+}
+
+static void sp_cb_playlist_moved(sp_playlistcontainer *pc, sp_playlist *playlist, int position, int new_position, void *userdata)
+{
+    struct sfs_entry *library, *entry;
+
+    if (!g_container_loaded) {
+        return;
+    }
+
+    g_debug("%s: %d -> %d", __func__, position, new_position);
+
+    pthread_rwlock_wrlock(&g_directory.lock);
+
+    library = spotify_get_playlists();
+
+    if ((entry = sfs_remove_child_at(library, position))) {
+        /* new position could be given before or after removal of the playlist */
+        if (new_position > position && sp_playlistcontainer_playlist(pc, new_position) != playlist) {
+            new_position--;
+        }
+
+        sfs_insert_child_entry(library, entry, new_position);
+    }
+
+    pthread_rwlock_unlock(&g_directory.lock);
+}
+
+/* load playlist into RAM and create its song list, called by worker with directory locked for writing */
+static void materialize_playlist(struct spotifs_context* ctx, struct sfs_entry* entry)
+{
+    struct playlist* playlist = entry->playlist;
+
+    g_debug("%s: %s", __func__, entry->name);
+
+    sp_playlist_set_in_ram(ctx->spotify_session, playlist->sp_playlist, 1);
+    playlist->materialized = 1;
+
+    /* not loaded playlist is filled by playlist_state_changed */
+    if (sp_playlist_is_loaded(playlist->sp_playlist)) {
+        build_playlist_tracks(entry);
+        playlist->loaded = 1;
+    }
+}
+
+/* materialize playlists requested by lookups, called by worker thread */
+static void materialize_requested(struct spotifs_context* ctx)
+{
+    struct sfs_entry *library, *entry;
+
+    if (!__atomic_exchange_n(&g_materialize_pending, 0, __ATOMIC_ACQ_REL)) {
+        return;
+    }
+
+    pthread_rwlock_wrlock(&g_directory.lock);
+
+    if ((library = spotify_get_playlists())) {
+        for (entry = library->children; entry; entry = entry->next) {
+            if (entry->playlist->requested && !entry->playlist->materialized) {
+                materialize_playlist(ctx, entry);
+            }
+        }
+    }
+
+    pthread_rwlock_unlock(&g_directory.lock);
+
+    notify_playlist_loads();
+}
+
+static int is_unmaterialized(struct sfs_entry* entry)
+{
+    return (entry->type & sfs_playlist) && !entry->playlist->materialized;
+}
+
+/* first playlist on the path, entry at the path included, NULL if there's none */
+static struct sfs_entry* playlist_on_path(const char* path, int ancestors_only)
+{
+    char prefix[PATH_MAX];
+    const size_t length = strlen(path);
+    size_t i;
+
+    if (length >= sizeof(prefix)) {
+        return NULL;
+    }
+
+    memcpy(prefix, path, length + 1);
+
+    for (i = 1; i <= length; i++) {
+        if (prefix[i] == '/' || (!prefix[i] && !ancestors_only)) {
+            struct sfs_entry* entry;
+
+            prefix[i] = 0;
+            entry = sfs_get(&g_directory.first, prefix);
+            prefix[i] = '/';
+
+            if (!entry) {
+                return NULL;
+            } else if (entry->type & sfs_playlist) {
+                return entry;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * wait until the playlist on the path is loaded, removed or timeout passes.
+ * Directory lock must be held, it's released on return. The playlist is
+ * looked up again after every change, it may be gone.
+ */
+static void wait_for_playlist(const char* path)
+{
+    struct sfs_entry* playlist;
+    struct timespec deadline;
+    unsigned long loads;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += PLAYLIST_LOAD_TIMEOUT_MS / 1000;
+
+    for (;;) {
+        /* read with the tree locked, so no change after the check is missed */
+        pthread_mutex_lock(&g_playlist_load_mutex);
+        loads = g_playlist_loads;
+        pthread_mutex_unlock(&g_playlist_load_mutex);
+
+        playlist = playlist_on_path(path, 0);
+
+        if (!playlist || playlist->playlist->loaded) {
+            spotify_unlock_directory();
+            return;
+        }
+
+        spotify_unlock_directory();
+
+        pthread_mutex_lock(&g_playlist_load_mutex);
+
+        while (loads == g_playlist_loads) {
+            if (pthread_cond_timedwait(&g_playlist_load_cond, &g_playlist_load_mutex, &deadline) == ETIMEDOUT) {
+                g_debug("%s: timedout", __func__);
+                pthread_mutex_unlock(&g_playlist_load_mutex);
+                return;
+            }
+        }
+
+        pthread_mutex_unlock(&g_playlist_load_mutex);
+
+        spotify_lock_directory(0);
+    }
+}
+
+struct sfs_entry* spotify_lookup(struct spotifs_context* ctx, const char* path, int flags)
+{
+    const int write = flags & SPOTIFY_LOOKUP_WRITE;
+    struct sfs_entry *entry, *playlist;
+
+    spotify_lock_directory(write);
+
+    /* existing entries are inside materialized playlists, only misses and
+     * listings of playlists need more work */
+    if ((entry = sfs_get(&g_directory.first, path))) {
+        if (!(flags & SPOTIFY_LOOKUP_LIST) || !is_unmaterialized(entry)) {
+            return entry;
+        }
+    } else if (!(playlist = playlist_on_path(path, 1)) || !is_unmaterialized(playlist)) {
+        return NULL;
+    }
+
+    spotify_unlock_directory();
+    spotify_lock_directory(1);
+
+    /* state could change while the lock was released. libspotify is used
+     * only by worker, it materializes the playlist and this thread waits. */
+    if ((playlist = playlist_on_path(path, 0)) && is_unmaterialized(playlist)) {
+        if (!playlist->playlist->requested) {
+            playlist->playlist->requested = 1;
+            __atomic_store_n(&g_materialize_pending, 1, __ATOMIC_RELEASE);
+            wake_worker(ctx);
+        }
+
+        wait_for_playlist(path);
+    } else {
+        spotify_unlock_directory();
+    }
+
+    spotify_lock_directory(write);
+    return sfs_get(&g_directory.first, path);
+}
+
+static sp_playlistcontainer_callbacks pc_callbacks = {
+    .playlist_added = &sp_cb_playlist_added,
+    .playlist_removed = &sp_cb_playlist_removed,
+    .playlist_moved = &sp_cb_playlist_moved,
+    .container_loaded = &sp_cb_container_loaded,
+};
+
+static void sp_cb_offline_status_updated(sp_session *session)
+{
+    g_debug("%s: new status: %d", __func__, sp_session_connectionstate(session));
+}
+
+static void sp_cb_connectionstate_updated(sp_session* session)
+{
+    g_debug("%s: new status: %d", __func__, sp_session_connectionstate(session));
+}
+
+// handle logged in event
+static void sp_cb_logged_in(sp_session *sess, sp_error error)
+{
+    struct spotifs_context* ctx = sp_session_userdata(sess);
+
+    assert(ctx != NULL);
+    assert(ctx->spotify_session == sess);
+
+    pthread_mutex_lock(&ctx->lock);
+
+    if (SP_ERROR_OK != error) {
+        ctx->logged_in = -1;
+        g_error("%s: got error: '%s'", __func__, sp_error_message(error));
+    }
+    else
+    {
+        ctx->logged_in = 1;
+        __atomic_store_n(&g_login_ns, stats_clock() - g_login_started, __ATOMIC_RELAXED);
+        g_debug("%s: logged in", __func__);
+    }
+
+    // signal that login is completed
+    pthread_cond_signal(&ctx->change);
+    pthread_mutex_unlock(&ctx->lock);
+
+    ctx->spotify_playlist_container = sp_session_playlistcontainer(ctx->spotify_session);
+
+    /* callbacks are needed also after load, to follow changes of the container */
+    sp_playlistcontainer_add_callbacks(ctx->spotify_playlist_container, &pc_callbacks, ctx);
+
+    if (sp_playlistcontainer_is_loaded(ctx->spotify_playlist_container)) {
+        sp_cb_container_loaded(ctx->spotify_playlist_container, ctx);
+    }
+
+    g_debug("%s: exit", __func__);
+}
+
+static void sp_cb_logged_out(sp_session *sess)
+{
+    struct spotifs_context* ctx = sp_session_userdata(sess);
+    g_debug("%s: logged out", __func__);
+
+    pthread_mutex_lock(&ctx->lock);
+
+    /* notify worker thread to exit */
+    ctx->spotify_event = 1;
+    ctx->worker_running = 0;
+
+    pthread_cond_signal(&ctx->change);
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+static void sp_cb_notify_main_thread(sp_session *session)
+{
+    wake_worker(sp_session_userdata(session));
+}
+
+static int sp_cb_music_delivery(sp_session *session, const sp_audioformat *format, const void *frames, int num_frames)
+{
+    struct track_waiter* restart = NULL;
+    struct track* track;
+    int prefetch = 0;
+
+    /* player calls of worker can wait for delivery in progress while it holds
+     * the locks, so they are only tried. Frames not consumed are delivered again. */
+    if (pthread_mutex_trylock(&current_track_mutex)) {
+        return 0;
+    }
+
+    if (!(track = g_current_track)) {
+        pthread_mutex_unlock(&current_track_mutex);
+        return num_frames;
+    }
+
+    if (pthread_mutex_trylock(&track->lock)) {
+        pthread_mutex_unlock(&current_track_mutex);
+        return 0;
+    }
+
+    if (!buffer_is_initialized(&track->buffer))
+    {
+        if (buffer_init(&track->buffer, wave_size(2, format->channels, format->sample_rate, track->duration)) < 0) {
+            g_warning("%s: can't allocate buffer", __func__);
+            pthread_mutex_unlock(&track->lock);
+            pthread_mutex_unlock(&current_track_mutex);
+            return num_frames;
+        }
+
+        track->size = track->buffer.capacity + wave_header_size();
+        track->sample_rate = format->sample_rate;
+        track->channels = format->channels;
+
+        g_debug("%s: allocating buffer: channels: %d, sample rate: %d, duration: %d, size: %zu",
+            __func__, format->channels, format->sample_rate, track->duration, track->buffer.capacity);
+    }
+
+    /* assume that these values can't change */
+    assert(track->sample_rate == format->sample_rate);
+    assert(track->channels == format->channels);
+
+    const size_t data_bytes = num_frames * 2 * format->channels;
+    const size_t stored = buffer_write(&track->buffer, frames, data_bytes);
+
+    if (stored < data_bytes) {
+        g_warning("%s: write beyound the buffer, stored: %zubytes, data: %zubytes", __func__, stored, data_bytes);
+    }
+
+    g_playing_delivered += num_frames * 1000000000ULL / format->sample_rate;
+    stats_add(STATS_DELIVERED_BYTES, data_bytes);
+    stats_add(STATS_DELIVERED_NS, num_frames * 1000000000ULL / format->sample_rate);
+
+    publish_extent(track);
+
+    /* player API can't be used here, prefetching is done by worker thread.
+     * Only data played from the start counts, not a seek probing the tail. */
+    if (g_prefetch_threshold && !track->prefetched
+        && buffer_available(&track->buffer, 0) >= track->buffer.capacity / 100 * g_prefetch_threshold) {
+        track->prefetched = 1;
+        g_prefetch_request = track;
+        prefetch = 1;
+    }
+
+    wake_readers(track, track->published_end, &restart);
+    wake_stranded_readers(track, &restart);
+    pthread_mutex_unlock(&track->lock);
+    pthread_mutex_unlock(&current_track_mutex);
+
+    /* this thread must not block, woken asynchronous reads are copied and replied by worker */
+    queue_restarts(sp_session_userdata(session), restart);
+
+    if (prefetch) {
+        wake_worker(sp_session_userdata(session));
+    }
+
+    return num_frames;
+}
+
+static void sp_cb_connection_error(sp_session *session, sp_error error)
+{
+    g_warning("%s: %s", __func__, sp_error_message(error));
+}
+
+static void sp_cb_play_token_lost(sp_session *session)
+{
+    g_info("%s: Play token lost", __func__);
+}
+
+static void sp_cb_log_message(sp_session *session, const char *data)
+{
+}
+
+static void sp_cb_end_of_track(sp_session *session)
+{
+    struct spotifs_context *ctx = sp_session_userdata(session);
+    struct track_waiter* restart = NULL;
+
+    pthread_mutex_lock(&current_track_mutex);
+
+    if (g_current_track) {
+        struct track* track = g_current_track;
+
+        /* pad rest of the buffer with silence & stop buffering */
+        pthread_mutex_lock(&track->lock);
+        buffer_fill_tail(&track->buffer);
+        publish_extent(track);
+        wake_readers(track, track->buffer.capacity, &restart);
+        /* readers behind the stream have to seek, nothing comes after the end */
+        wake_all_readers(track, &restart);
+        pthread_mutex_unlock(&track->lock);
+
+        sp_session_player_play(ctx->spotify_session, 0);
+        player_stopped();
+    }
+
+    pthread_mutex_unlock(&current_track_mutex);
+
+    queue_restarts(ctx, restart);
+
+    /* let the scheduler give player to other track */
+    wake_worker(ctx);
+
+    g_debug("End of track");
+
+}
+
+static void streaming_error(sp_session *session, sp_error error)
+{
+    g_error("%s: %s", __func__, sp_error_message(error));
+}
+
+/* tracks which couldn't be loaded into player can be retried, called by worker */
+static void sp_cb_metadata_updated(sp_session *session)
+{
+    struct track* track;
+
+    pthread_mutex_lock(&current_track_mutex);
+
+    /* scheduler runs after events are processed */
+    for (track = g_open_tracks; track; track = track->next_open) {
+        track->loading = 0;
+    }
+
+    pthread_mutex_unlock(&current_track_mutex);
+}
+
+static sp_session_callbacks session_callbacks = {
+    .logged_in = &sp_cb_logged_in,
+    .logged_out = &sp_cb_logged_out,
+    .notify_main_thread = &sp_cb_notify_main_thread,
+    .music_delivery = &sp_cb_music_delivery,
+    .connection_error = &sp_cb_connection_error,
+    .play_token_lost = &sp_cb_play_token_lost,
+    .log_message = &sp_cb_log_message,
+    .end_of_track = &sp_cb_end_of_track,
+    .metadata_updated = &sp_cb_metadata_updated,
+    .streaming_error = &streaming_error,
+    .offline_status_updated = &sp_cb_offline_status_updated,
+    .connectionstate_updated = &sp_cb_connectionstate_updated,
+    NULL,
+};
+
+static sp_session_config spconfig = {
+    .api_version = SPOTIFY_API_VERSION,
+    .cache_location = "tmp",
+    .settings_location = "tmp",
+    .application_key = g_appkey,
+    .application_key_size = 0,
+    .user_agent = "spotify-fs-example",
     .callbacks = &session_callbacks,
+    /* playlists are loaded into RAM when browsed */
+    .initially_unload_playlists = 1,
     NULL,
 };
 
@@ -413,14 +1987,28 @@ int spotify_connect(struct spotifs_context* ctx, const char *username, const cha
     pthread_mutexattr_settype(&current_track_mutex_attr, PTHREAD_MUTEX_RECURSIVE);
     pthread_mutex_init(&current_track_mutex, &current_track_mutex_attr);
 
+    /* worker deadlines are computed with monotonic clock */
+    pthread_condattr_t change_attr;
+    pthread_condattr_init(&change_attr);
+    pthread_condattr_setclock(&change_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&ctx->change, &change_attr);
+    pthread_condattr_destroy(&change_attr);
+
     /* we need to start worker thread at this point */
     if (0 != start_worker_thread(ctx))
     {
-        g_error("%s: can't create worker thread", __func__);
+        g_error("%s: can't create worker thread", __func__);
+        return -3;
+    }
+
+    if (start_prefetcher() < 0)
+    {
+        g_error("%s: can't create prefetcher thread", __func__);
         return -3;
     }
 
     ctx->logged_in = 2;
+    g_login_started = stats_clock();
     sp_session_login(ctx->spotify_session, username, password, 0, NULL);
 
     pthread_mutex_lock(&ctx->lock);
@@ -449,79 +2037,367 @@ void spotify_disconnect(struct spotifs_context* ctx)
     }
 
     stop_worker_thread(ctx);
+    stop_prefetcher();
+
+    /* buffering is stopped without the directory lock */
+    release_prefetched_track(ctx);
+    /* worker is stopped, this thread is the only one using libspotify */
+    release_stopped_tracks();
+
+    pthread_rwlock_wrlock(&g_directory.lock);
+
+    if (spotify_get_playlists()) {
+        release_playlists(spotify_get_playlists());
+    }
+
+    while (g_retired_arenas) {
+        free_retired_arena(g_retired_arenas);
+    }
+
+    arena_release(&g_retired_arena);
+    g_container_loaded = 0;
+    pthread_rwlock_unlock(&g_directory.lock);
+}
+
+/* name of cache files for the track, based on its spotify URI */
+static void track_cache_key(struct track* track, char* key, size_t size)
+{
+    snprintf(key, size, "%s", track->link ? track->link : "");
+    replace_character(key, ':', '_');
+}
+
+/* set format of the track from cache, size of the file is known before any delivery */
+static void track_set_format(struct track* track, const struct cache_info* info)
+{
+    track->channels = info->channels;
+    track->sample_rate = info->sample_rate;
+    track->size = info->capacity + wave_header_size();
 }
 
 int spotify_buffer_track(struct spotifs_context* ctx, struct track* track)
 {
+    struct stream_buffer buffer;
+    struct cache_info info;
+    char key[128] = {0};
+    int loaded = 0;
+
+    pthread_mutex_lock(&track->open_lock);
+
+    /* opened by somebody else before */
+    if (track->buffering) {
+        pthread_mutex_unlock(&track->open_lock);
+        return 0;
+    }
+
     g_debug(__func__);
 
-    sp_error err;
-    int ret = 0;
+    /* worker references the spotify track of open tracks, see reference_open_tracks */
+    track->buffering = 1;
 
-    pthread_mutex_lock(&current_track_mutex);
+    /* cache is read before taking any lock shared with deliveries */
+    if (cache_enabled()) {
+        track_cache_key(track, key, sizeof(key));
 
-    if (g_current_track) {
-        pthread_mutex_unlock(&current_track_mutex);
-        return -1;
+        if ((track->cache_fd = cache_open_complete(key, &info)) >= 0) {
+            g_debug("%s: %s served from cache", __func__, key);
+            stats_add(STATS_CACHE_HITS, 1);
+            track_set_format(track, &info);
+            pthread_mutex_unlock(&track->open_lock);
+            return 0;
+        }
+
+        if ((loaded = cache_load(key, &info, &buffer) == 0)) {
+            stats_add(STATS_CACHE_PARTIAL, 1);
+        } else {
+            stats_add(STATS_CACHE_MISSES, 1);
+        }
     }
 
-    assert(g_current_track == NULL);
-    g_current_track = track;
+    pthread_mutex_lock(&current_track_mutex);
+    pthread_mutex_lock(&track->lock);
 
-    // load and play
-    if(SP_ERROR_OK != (err = sp_session_player_load(ctx->spotify_session, track->spotify_track)))
-    {
-        g_error("spotify_buffer_track: sp_session_player_load: %s", sp_error_message(err));
-        g_current_track = NULL;
-        ret = -1;
+    if (loaded) {
+        /* continue streaming after the cached beginning of the track */
+        track_set_format(track, &info);
+        track->buffer = buffer;
+        buffer_seek(&track->buffer, buffer_available(&track->buffer, 0));
     }
 
-    if (SP_ERROR_OK != (err = sp_session_player_play(ctx->spotify_session, 1)))
-    {
-        g_error("spotify_buffer_track: sp_session_player_play: %s", sp_error_message(err));
-        g_current_track = NULL;
-        ret = -1;
-    }
+    publish_extent(track);
+
+    /* readers of the previous open were failed by stop_buffering, sleeping ones leave by themselves */
+    track->error = 0;
+    track->waiting = NULL;
+    track->seek_pending = 0;
+    pthread_mutex_unlock(&track->lock);
+
+    track->prefetched = 0;
+    track->loading = 0;
+    track->next_open = g_open_tracks;
+    g_open_tracks = track;
 
     pthread_mutex_unlock(&current_track_mutex);
+    pthread_mutex_unlock(&track->open_lock);
 
-    return ret;
+    /* player is loaded by the scheduler in worker thread */
+    wake_worker(ctx);
+
+    return 0;
 }
 
-void spotify_buffer_stop(struct spotifs_context* ctx, struct track* track)
+/* tracks opened again before this was called keep buffering, the track is pinned by caller. */
+static void stop_buffering(struct spotifs_context* ctx, struct track* track)
 {
-    (void) track;
+    struct track_waiter* failed = NULL;
+    struct stream_buffer buffer;
+    struct track** link;
+
+    pthread_mutex_lock(&track->open_lock);
+
+    if (!track->buffering || __atomic_load_n(&track->refs, __ATOMIC_RELAXED)) {
+        pthread_mutex_unlock(&track->open_lock);
+        return;
+    }
 
     g_debug(__func__);
+
+    track->buffering = 0;
+
+    if (track->cache_fd >= 0) {
+        close(track->cache_fd);
+        track->cache_fd = -1;
+        pthread_mutex_unlock(&track->open_lock);
+        return;
+    }
+
     pthread_mutex_lock(&current_track_mutex);
 
-    assert(g_current_track != NULL);
+    for (link = &g_open_tracks; *link; link = &(*link)->next_open) {
+        if (*link == track) {
+            *link = track->next_open;
+            break;
+        }
+    }
+
+    track->next_open = NULL;
 
-    sp_session_player_play(ctx->spotify_session, 0); /* pause and unload */
-    sp_session_player_unload(ctx->spotify_session);
+    if (g_prefetch_request == track) {
+        g_prefetch_request = NULL;
+    }
 
-    free(g_current_track->buffer.data);
-    g_current_track->buffer.data = NULL;
-    g_current_track = NULL;
+    /* deliveries for the track are dropped until worker unloads the player */
+    if (g_current_track == track) {
+        player_stopped();
+        g_current_track = NULL;
+    }
+
+    /* buffer is taken over, so saving it to the cache doesn't block deliveries */
+    pthread_mutex_lock(&track->lock);
+    buffer = track->buffer;
+    memset(&track->buffer, 0, sizeof(struct stream_buffer));
+    publish_extent(track);
+
+    /* nothing is going to be streamed, queued readers get an error */
+    track->error = 1;
+    wake_all_readers(track, &failed);
+    pthread_mutex_unlock(&track->lock);
 
     pthread_mutex_unlock(&current_track_mutex);
+
+    unqueue_restarts(track, &failed);
+    fail_reads(failed, -EIO);
+
+    wake_worker(ctx);
+
+    /* opening the track again waits for the store, so it loads the stored data */
+    if (cache_enabled() && buffer_is_initialized(&buffer)) {
+        struct cache_info info = {
+            .channels = track->channels,
+            .sample_rate = track->sample_rate,
+            .capacity = buffer.capacity,
+        };
+        char key[128];
+
+        track_cache_key(track, key, sizeof(key));
+        cache_store(key, &info, &buffer);
+    }
+
+    buffer_release(&buffer);
+
+    pthread_mutex_unlock(&track->open_lock);
 }
 
-int spotify_read(struct spotifs_context* ctx, struct track* track, off_t offset, size_t size, char *buffer)
+/* worker drops the spotify reference and the pin, returns 0 if it already has the track queued */
+static int queue_stopped_track(struct spotifs_context* ctx, struct track* track)
 {
-    int copied = 0;
+    int queued = 0;
 
     pthread_mutex_lock(&current_track_mutex);
 
-    g_debug("%s: read(%zu, %zu), buffer(%zu, %zu)\n", __func__, offset, size, g_current_track->buffer.pointer, g_current_track->buffer.capacity);
+    if (!track->stop_queued) {
+        track->stop_queued = 1;
+        track->next_stopped = g_stopped_tracks;
+        g_stopped_tracks = track;
+        queued = 1;
+    }
+
+    pthread_mutex_unlock(&current_track_mutex);
 
-    /* wait for any data, proper size will be calculated after first data arrive */
-    while(!g_current_track->buffer.data) {
-        pthread_cond_wait(&current_track_cond, &current_track_mutex);
+    if (queued) {
+        wake_worker(ctx);
+    }
+
+    return queued;
+}
+
+void spotify_release_track(struct spotifs_context* ctx, struct track* track)
+{
+    int refs;
+
+    pthread_rwlock_wrlock(&g_directory.lock);
+    refs = __atomic_sub_fetch(&track->refs, 1, __ATOMIC_RELAXED);
+
+    /* playlist callbacks keep memory of the track until buffering is stopped */
+    if (!refs) {
+        track->stopping++;
+    }
+
+    pthread_rwlock_unlock(&g_directory.lock);
+
+    if (!refs) {
+        /* storing the buffer to the cache doesn't block the tree */
+        stop_buffering(ctx, track);
+    }
+
+    /* stopped track is passed to worker, which releases the spotify track and drops the pin */
+    if (!refs && !queue_stopped_track(ctx, track)) {
+        /* track isn't touched after this, it can be freed by the next change of its playlist */
+        pthread_rwlock_wrlock(&g_directory.lock);
+        unpin_track(track);
+        pthread_rwlock_unlock(&g_directory.lock);
+    }
+}
+
+/* add reader to the queue, so the scheduler gives player to the track. track->lock must be held */
+static void queue_waiter(struct spotifs_context* ctx, struct track* track, struct track_waiter* waiter)
+{
+    struct track_waiter** link = &track->waiting;
+
+    /* current track is only a hint here, scheduler checks waiters under its lock */
+    if (track != __atomic_load_n(&g_current_track, __ATOMIC_RELAXED)) {
+        wake_worker(ctx);
+    }
+
+    /* readers needing the same end are woken in order of arrival */
+    while (*link && (*link)->offset + (*link)->size <= waiter->offset + waiter->size) {
+        link = &(*link)->next;
+    }
+
+    waiter->next = *link;
+    *link = waiter;
+
+    track->waiters++;
+}
+
+/*
+ * register as waiting reader and sleep until the range is present, track
+ * fails or deadline (CLOCK_MONOTONIC, optional) passes. Returns ETIMEDOUT in
+ * the latter case. Asynchronous read is only queued and EINPROGRESS is
+ * returned. track->lock must be held.
+ */
+static int wait_for_data(struct spotifs_context* ctx, struct track* track, off_t offset, size_t size,
+    const struct timespec* deadline, struct async_read* async)
+{
+    struct track_waiter waiter = { .offset = offset, .size = size };
+    struct track_waiter** link;
+    pthread_condattr_t attr;
+    uint64_t start;
+    int ret = 0;
+
+    stats_add(STATS_READ_WAITS, 1);
+
+    if (async) {
+        memset(&async->waiter, 0, sizeof(async->waiter));
+        async->waiter.offset = offset;
+        async->waiter.size = size;
+        async->waiter.async = async;
+
+        /* waiting time is counted when the read finishes */
+        if (!async->queued) {
+            async->queued = stats_clock();
+        }
+
+        queue_waiter(ctx, track, &async->waiter);
+        return EINPROGRESS;
+    }
+
+    start = stats_clock();
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&waiter.cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    queue_waiter(ctx, track, &waiter);
+
+    while (!waiter.woken) {
+        if (!deadline) {
+            pthread_cond_wait(&waiter.cond, &track->lock);
+        } else if (pthread_cond_timedwait(&waiter.cond, &track->lock, deadline) == ETIMEDOUT && !waiter.woken) {
+            /* nobody dequeued us, leave the queue by ourselves */
+            for (link = &track->waiting; *link != &waiter; link = &(*link)->next);
+            *link = waiter.next;
+
+            ret = ETIMEDOUT;
+            break;
+        }
+    }
+
+    track->waiters--;
+    pthread_cond_destroy(&waiter.cond);
+    stats_add(STATS_READ_WAIT_NS, stats_clock() - start);
+
+    return ret;
+}
+
+/*
+ * copy part of wave header covered by the read, offset, size and buffer
+ * are adjusted to the remaining PCM data. Returns number of bytes copied.
+ */
+static size_t read_header(struct track* track, off_t* offset, size_t* size, char** buffer)
+{
+    char header[64];
+    size_t copied = 0;
+
+    assert(sizeof(header) >= wave_header_size());
+
+    if (*offset < wave_header_size()) {
+        copied = wave_header_size() - *offset;
+
+        if (copied > *size) {
+            copied = *size;
+        }
+
+        wave_standard_header(track->size, header);
+        memcpy(*buffer, header + *offset, copied);
+
+        *buffer += copied;
+        *size -= copied;
+        *offset = 0;
+    } else {
+        *offset -= wave_header_size();
     }
 
+    return copied;
+}
+
+/* completely cached tracks are served straight from the cache file, without locking */
+static int read_cached(struct track* track, off_t offset, size_t size, char *buffer)
+{
+    ssize_t bytes;
+    int copied;
+
     if (offset >= track->size) {
-        pthread_mutex_unlock(&current_track_mutex);
         return 0;
     }
 
@@ -529,43 +2405,329 @@ int spotify_read(struct spotifs_context* ctx, struct track* track, off_t offset,
         size = track->size - offset;
     }
 
-    /* copy header if needed */
-    if (offset < wave_header_size()) {
-        if (offset + size < wave_header_size()) {
-            /* read only in header */
-            memcpy(buffer, wave_standard_header(g_current_track->size) + offset, size);
-            pthread_mutex_unlock(&current_track_mutex);
-            return size;
-        } else {
-            /* read exceed header */
-            copied = wave_header_size() - offset;
+    copied = read_header(track, &offset, &size, &buffer);
+
+    if (!size) {
+        return copied;
+    }
+
+    if ((bytes = pread(track->cache_fd, buffer, size, offset)) < 0) {
+        return -errno;
+    }
+
+    return copied + bytes;
+}
+
+int spotify_track_complete(struct track* track)
+{
+    int complete;
+
+    if (track->cache_fd >= 0) {
+        return 1;
+    }
+
+    pthread_mutex_lock(&track->lock);
+    complete = buffer_is_initialized(&track->buffer) && buffer_has(&track->buffer, 0, track->buffer.capacity);
+    pthread_mutex_unlock(&track->lock);
+
+    return complete;
+}
 
-            memcpy(buffer, wave_standard_header(g_current_track->size) + offset, copied);
+int spotify_cached_range(struct track* track, off_t offset, size_t* size, off_t* position)
+{
+    if (track->cache_fd < 0 || offset < wave_header_size() || offset >= track->size) {
+        return -1;
+    }
+
+    if (offset + *size >= track->size) {
+        *size = track->size - offset;
+    }
+
+    *position = offset - wave_header_size();
+    return track->cache_fd;
+}
+
+/*
+ * wait until range is buffered, seek if first missing byte is not going to
+ * be delivered soon by linear streaming. With short reads only the first
+ * byte is waited for, after the maximum wait passes too. Size is set to the
+ * number of bytes which can be copied. Returns -EIO if track failed,
+ * -EAGAIN if nothing is buffered and read can't block or -EINPROGRESS if
+ * asynchronous read was queued.
+ */
+static int wait_for_range(struct spotifs_context* ctx, struct track* track, off_t offset, size_t* size, int flags,
+    struct async_read* async)
+{
+    const struct timespec* timeout = NULL;
+    struct timespec deadline;
+    size_t needed = *size;
+    int ret = 0;
+
+    if (g_short_reads || (flags & SPOTIFY_READ_NONBLOCK)) {
+        needed = 1;
+    } else if (g_max_wait_ms) {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        timespec_add_ms(&deadline, g_max_wait_ms);
+        timeout = &deadline;
+    }
 
-            buffer += copied;
-            offset = 0;
-            size -= copied;
+    pthread_mutex_lock(&track->lock);
+
+    while(!buffer_has(&track->buffer, offset, needed) && !track->error) {
+        const off_t missing = offset + buffer_available(&track->buffer, offset);
+
+        /* readers already served by the stream keep it, this one is woken after them */
+        if (!stream_reaches(track, missing) && !stream_serves_readers(track)) {
+            /* player is used only by worker, the reader waits for the data as usual */
+            track->seek_pending = 1;
+            track->seek_offset = missing;
+            wake_worker(ctx);
+        }
+
+        if (flags & SPOTIFY_READ_NONBLOCK) {
+            /* data is going to be streamed, let the scheduler know about it */
+            if (track != __atomic_load_n(&g_current_track, __ATOMIC_RELAXED)) {
+                wake_worker(ctx);
+            }
+
+            ret = -EAGAIN;
+            break;
+        }
+
+        if ((ret = wait_for_data(ctx, track, offset, needed, timeout, async)) == EINPROGRESS) {
+            ret = -EINPROGRESS;
+            break;
+        } else if (ret == ETIMEDOUT) {
+            g_debug("%s: timedout, returning short read", __func__);
+            timeout = NULL;
+            needed = 1;
+            ret = 0;
         }
-    } else {
-        offset -= wave_header_size();
     }
 
-    /* wait for data if needed */
-    while(offset + size > g_current_track->buffer.pointer) {
-        pthread_cond_wait(&current_track_cond, &current_track_mutex);
+    if (track->error) {
+        ret = -EIO;
+    } else if (!ret) {
+        const size_t available = buffer_available(&track->buffer, offset);
+
+        if (*size > available) {
+            *size = available;
+        }
     }
 
-    copied += size;
-    memcpy(buffer, g_current_track->buffer.data + offset, size);
+    pthread_mutex_unlock(&track->lock);
 
-    g_debug("%s", __func__);
+    return ret;
+}
 
-    pthread_mutex_unlock(&current_track_mutex);
+/* spotify_read, which queues async and returns -EINPROGRESS instead of sleeping */
+static int read_track(struct spotifs_context* ctx, struct track* track, off_t offset, size_t size, char *buffer, int flags,
+    struct async_read* async)
+{
+    int copied = 0, ret;
+
+    if (track->cache_fd >= 0) {
+        return read_cached(track, offset, size, buffer);
+    }
+
+    pthread_mutex_lock(&track->lock);
+
+    g_debug("%s: read(%zu, %zu), buffer(%zu, %zu)\n", __func__, offset, size, track->buffer.write_pointer, track->buffer.capacity);
+
+    /* wait for any data, proper size will be calculated after first data arrive */
+    while(!buffer_is_initialized(&track->buffer) && !track->error) {
+        if (flags & SPOTIFY_READ_NONBLOCK) {
+            pthread_mutex_unlock(&track->lock);
+            wake_worker(ctx);
+            return -EAGAIN;
+        }
+
+        if (wait_for_data(ctx, track, 0, 0, NULL, async) == EINPROGRESS) {
+            pthread_mutex_unlock(&track->lock);
+            return -EINPROGRESS;
+        }
+    }
+
+    if (track->error) {
+        pthread_mutex_unlock(&track->lock);
+        return -EIO;
+    }
+
+    pthread_mutex_unlock(&track->lock);
+
+    if (offset >= track->size) {
+        return 0;
+    }
+
+    if (offset + size >= track->size) {
+        size = track->size - offset;
+    }
+
+    copied = read_header(track, &offset, &size, &buffer);
+
+    if (!size) {
+        /* read only in header */
+        return copied;
+    }
+
+    /* data behind the stream or in an older extent needs the lock only for the check */
+    if (!published_has(track, offset, size) && (ret = wait_for_range(ctx, track, offset, &size, flags, async)) < 0) {
+        /* header part is returned as a short read, restarted read copies it again */
+        return copied && ret != -EINPROGRESS ? copied : ret;
+    }
+
+    /* present data never changes, it's copied without any lock held */
+    copied += buffer_copy(&track->buffer, offset, size, buffer);
 
     return copied;
 }
 
+int spotify_read(struct spotifs_context* ctx, struct track* track, off_t offset, size_t size, char *buffer, int flags)
+{
+    return read_track(ctx, track, offset, size, buffer, flags, NULL);
+}
+
+/* read is done or queued again, e.g. after a seek */
+static void run_async_read(struct async_read* async)
+{
+    const int ret = read_track(async->ctx, async->track, async->offset, async->size, async->buffer, async->flags, async);
+
+    if (ret != -EINPROGRESS) {
+        if (async->queued) {
+            stats_add(STATS_READ_WAIT_NS, stats_clock() - async->queued);
+        }
+
+        async->callback(async->data, async->buffer, ret);
+        free(async);
+    }
+}
+
+static void restart_reads(struct track_waiter* restart)
+{
+    while (restart) {
+        struct async_read* async = restart->async;
+
+        restart = restart->next;
+        run_async_read(async);
+    }
+}
+
+/* reply queued reads with an error without touching their track */
+static void fail_reads(struct track_waiter* failed, int error)
+{
+    while (failed) {
+        struct async_read* async = failed->async;
+
+        failed = failed->next;
+        async->callback(async->data, async->buffer, error);
+        free(async);
+    }
+}
+
+void spotify_read_async(struct spotifs_context* ctx, struct track* track, off_t offset, size_t size, char *buffer, int flags,
+    spotify_read_callback callback, void* data)
+{
+    struct async_read* async;
+
+    /* there's no timer for queued reads, bounded waits keep sleeping in the caller */
+    if (g_max_wait_ms && !g_short_reads && !(flags & SPOTIFY_READ_NONBLOCK)) {
+        callback(data, buffer, spotify_read(ctx, track, offset, size, buffer, flags));
+        return;
+    }
+
+    if (!(async = malloc(sizeof(struct async_read)))) {
+        callback(data, buffer, -ENOMEM);
+        return;
+    }
+
+    async->ctx = ctx;
+    async->track = track;
+    async->offset = offset;
+    async->size = size;
+    async->buffer = buffer;
+    async->flags = flags;
+    async->callback = callback;
+    async->data = data;
+    async->queued = 0;
+
+    run_async_read(async);
+}
+
 struct track* spotify_current(struct spotifs_context* ctx)
 {
     return g_current_track;
 }
+
+/*
+ * labels of open track, playlist/track as in the tree and its URI, which
+ * is unique. The URI was stored by worker when the entry was created, no
+ * libspotify call is made here.
+ */
+static void append_track_label(GString* out, struct track* track)
+{
+    g_string_append(out, "track=\"");
+
+    if (track->entry && track->entry->parent) {
+        stats_append_label(out, track->entry->parent->name);
+        g_string_append_c(out, '/');
+    }
+
+    stats_append_label(out, track->entry ? track->entry->name : "");
+    g_string_append(out, "\",link=\"");
+    stats_append_label(out, track->link);
+    g_string_append_c(out, '"');
+}
+
+void spotify_write_stats(GString* out)
+{
+    struct track* track;
+    size_t resident = 0;
+    double ratio = 0;
+    int open = 0;
+
+    stats_describe(out, "spotifs_login_seconds", "gauge", "Time from requesting login until the session was logged in.");
+    g_string_append_printf(out, "spotifs_login_seconds %.6f\n", __atomic_load_n(&g_login_ns, __ATOMIC_RELAXED) / 1e9);
+    stats_describe(out, "spotifs_container_load_seconds", "gauge", "Time from login until the playlist container was loaded.");
+    g_string_append_printf(out, "spotifs_container_load_seconds %.6f\n", __atomic_load_n(&g_container_load_ns, __ATOMIC_RELAXED) / 1e9);
+
+    stats_describe(out, "spotifs_track_buffered_ratio", "gauge", "Buffered part of tracks being streamed.");
+    pthread_mutex_lock(&current_track_mutex);
+
+    for (track = g_open_tracks; track; track = track->next_open) {
+        double buffered = 0;
+
+        pthread_mutex_lock(&track->lock);
+
+        if (buffer_is_initialized(&track->buffer)) {
+            buffered = (double)buffer_filled(&track->buffer) / track->buffer.capacity;
+            resident += buffer_resident(&track->buffer);
+        }
+
+        pthread_mutex_unlock(&track->lock);
+
+        open++;
+
+        /* without the URI its labels could be the same as of another track */
+        if (!track->link) {
+            continue;
+        }
+
+        g_string_append(out, "spotifs_track_buffered_ratio{");
+        append_track_label(out, track);
+        g_string_append_printf(out, "} %.4f\n", buffered);
+    }
+
+    /* includes the running stream, unlike spotifs_player_seconds_total */
+    if (g_playing_since && stats_clock() > g_playing_since) {
+        ratio = (double)g_playing_delivered / (stats_clock() - g_playing_since);
+    }
+
+    pthread_mutex_unlock(&current_track_mutex);
+
+    stats_describe(out, "spotifs_streaming_tracks", "gauge", "Tracks open and not served from complete cache files.");
+    g_string_append_printf(out, "spotifs_streaming_tracks %d\n", open);
+    stats_describe(out, "spotifs_buffer_resident_bytes", "gauge", "Memory allocated for buffers of streamed tracks.");
+    g_string_append_printf(out, "spotifs_buffer_resident_bytes %zu\n", resident);
+    stats_describe(out, "spotifs_delivery_realtime_ratio", "gauge", "Audio delivered per second of the running stream, 0 when the player is stopped.");
+    g_string_append_printf(out, "spotifs_delivery_realtime_ratio %.3f\n", ratio);
+}
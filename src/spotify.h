@@ -3,17 +3,15 @@
 
 #include "context.h"
 #include <stdint.h>
+#include <time.h>
 #include <pthread.h>
+#include <glib.h>
 #include "buffer.h"
+#include "arena.h"
 
 struct sfs_entry;
-
-struct stream_buffer
-{
-    char* data;
-    off_t pointer;
-    size_t capacity;
-};
+struct track_waiter;
+struct retired_arena;
 
 struct track
 {
@@ -21,28 +19,162 @@ struct track
     int channels;
     int sample_rate;
     int size;
+    /* open file handles and prefetching, changed atomically with directory write lock held */
     int refs;
+    /* releases of the last reference stopping buffering, memory of the track is kept meanwhile.
+     * Guarded by directory lock. */
+    int stopping;
+    /* worker holds a reference of spotify_track while the track is open, worker only */
+    int spotify_ref;
+    /* stopped track waits for worker to drop the reference and the pin, guarded by current_track_mutex */
+    int stop_queued;
+    struct track* next_stopped;
+
+    /* readers waiting for data and failure of loading the track into player */
+    int waiters;
+    int error;
+
+    /* player load found metadata not loaded yet, retried later; guarded by current_track_mutex */
+    int loading;
+    struct timespec loading_since;
+
+    /* PCM offset readers need the player seeked to, applied by worker thread */
+    int seek_pending;
+    off_t seek_offset;
 
     struct stream_buffer buffer;
+    struct track* next_open;
+
+    /* PCM file of completely cached track, -1 when track is streamed */
+    int cache_fd;
+
+    /*
+     * buffer or cache file is set up, guarded by open_lock which serializes
+     * spotify_buffer_track and stopping it. It's taken before any
+     * other lock, cache is read and written only with this one held.
+     */
+    int buffering;
+    pthread_mutex_t open_lock;
+
+    /* spotify URI, set by worker when the entry is created, names cache files and labels stats */
+    char* link;
+
+    /* directory entry, next one in the playlist is prefetched */
+    struct sfs_entry* entry;
+    int prefetched;
+
+    /* removed from the playlist while open, next one in playlist->removed */
+    struct track* next_removed;
+    /* memory of released playlist the open track is in, guarded by directory lock */
+    struct retired_arena* retired;
 
     struct sp_track* spotify_track;
+
+    /*
+     * guards buffer, waiters, error and seek, nested inside current_track_mutex.
+     * Readers waiting for data are queued in waiting, sorted by end of the
+     * range they need.
+     */
     pthread_mutex_t lock;
+    struct track_waiter* waiting;
+
+    /* extent being streamed into, published with seqlock for lock-free readers */
+    unsigned int published_seq;
+    off_t published_start;
+    off_t published_end;
 };
 
 struct playlist
 {
     struct sp_playlist* sp_playlist;
+
+    struct sfs_entry* entry;
+
+    /* tracks of the playlist with their entries, tracks removed while
+     * they were open stay in the arena until the playlist is rebuilt */
+    struct arena arena;
+    struct track* removed;
+
+    /* song list is created on first listing of the playlist or lookup inside it.
+     * Lookups request it, worker loads the playlist and it's complete when loaded. */
+    int requested;
+    int materialized;
+    int loaded;
 };
 
 struct sfs_entry* spotify_get_root();
 struct sfs_entry* spotify_get_playlists();
 
+/*
+ * tree is changed by playlist callbacks, lock must be held while entries
+ * are used. Opening tracks (refs) needs write lock, buffering is started
+ * after it's released.
+ */
+void spotify_lock_directory(int write);
+void spotify_unlock_directory();
+
+/* spotify_lookup flags */
+#define SPOTIFY_LOOKUP_WRITE (1 << 0)
+/* entry is going to be listed, playlist gets its song list */
+#define SPOTIFY_LOOKUP_LIST (1 << 1)
+
+/*
+ * find entry, playlists on the path are materialized if needed. Directory
+ * lock is held on return (also when NULL is returned).
+ */
+struct sfs_entry* spotify_lookup(struct spotifs_context* ctx, const char* path, int flags);
+
+/* percent of track buffered after which next track in the playlist is prefetched, 0 disables prefetching */
+void spotify_set_prefetch_threshold(int percent);
+
+/* return already buffered data instead of waiting for the whole range, only first byte is waited for */
+void spotify_set_short_reads(int enabled);
+/* return short read after waiting given time for the whole range, 0 waits forever */
+void spotify_set_max_wait(int ms);
+/* reads can return less than requested, files need direct_io */
+int spotify_partial_reads();
+
 int spotify_connect(struct spotifs_context* ctx, const char *username, const char *password);
 void spotify_disconnect(struct spotifs_context* ctx);
 
+/*
+ * start buffering of track with reference taken, nothing is done if it's
+ * buffering already. Release drops the reference, the last one stops
+ * buffering and stores the buffer to the cache. Directory lock must not be
+ * held for either.
+ */
 int spotify_buffer_track(struct spotifs_context* ctx, struct track* track);
-void spotify_buffer_stop(struct spotifs_context* ctx, struct track* track);
-int spotify_read(struct spotifs_context* ctx, struct track* track, off_t offset, size_t size, char *buffer);
+void spotify_release_track(struct spotifs_context* ctx, struct track* track);
+/* spotify_read flags */
+/* return -EAGAIN instead of waiting when nothing is buffered at offset */
+#define SPOTIFY_READ_NONBLOCK (1 << 0)
+
+int spotify_read(struct spotifs_context* ctx, struct track* track, off_t offset, size_t size, char *buffer, int flags);
+
+/* result is number of bytes read into buffer or negative errno */
+typedef void (*spotify_read_callback)(void* data, char* buffer, int result);
+
+/*
+ * spotify_read which doesn't sleep in the calling thread. When data is not
+ * buffered yet, the read is queued on the track and callback is called by
+ * the worker thread once it's delivered, otherwise it's called before
+ * returning. buffer
+ * must stay valid until callback is called. Reads bounded by max wait still
+ * sleep in the caller.
+ */
+void spotify_read_async(struct spotifs_context* ctx, struct track* track, off_t offset, size_t size, char *buffer, int flags,
+    spotify_read_callback callback, void* data);
+/*
+ * cache file and its position holding data of completely cached track at
+ * offset, size is clamped to the end of the track. Returns -1 if the track is
+ * streamed or offset is inside the header.
+ */
+int spotify_cached_range(struct track* track, off_t offset, size_t* size, off_t* position);
+/* whole track is cached or buffered, its data can't change anymore */
+int spotify_track_complete(struct track* track);
 struct track* spotify_current(struct spotifs_context* ctx);
 
+/* append player, login and open track gauges for /.stats, directory lock must be held */
+void spotify_write_stats(GString* out);
+
 #endif // SPOTIFS_SPOTIFY_H
@@ -0,0 +1,221 @@
+#include <stdio.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include "stats.h"
+
+struct stats_slot
+{
+    uint64_t counters[STATS_NUM_COUNTERS];
+    /* owned by a running thread */
+    int used;
+    struct stats_slot* next;
+};
+
+/* slots are never freed, only handed over to new threads */
+static struct stats_slot* g_slots = NULL;
+static pthread_mutex_t g_slots_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_key_t g_slot_key;
+static pthread_once_t g_slot_key_once = PTHREAD_ONCE_INIT;
+static __thread struct stats_slot* t_slot = NULL;
+
+static const char* g_op_names[TRACE_NUM_OPS] = {
+    "path", "lookup", "getattr", "readdir", "open", "release", "read"
+};
+
+/* counters following the per operation ones, samples of one metric are adjacent */
+static const struct
+{
+    const char* name;
+    const char* help;
+    /* labels of the sample, NULL if it has none */
+    const char* labels;
+    /* converts the counter to the unit of the metric */
+    double scale;
+} g_counters[STATS_NUM_COUNTERS] = {
+    [STATS_SPLICED_BYTES] = { "spotifs_spliced_bytes_total", "Bytes of reads spliced from cache files.", NULL, 1 },
+    [STATS_READ_WAITS] = { "spotifs_read_waits_total", "Times reads waited for data to be delivered.", NULL, 1 },
+    [STATS_READ_WAIT_NS] = { "spotifs_read_wait_seconds_total", "Time reads spent waiting for data.", NULL, 1e-9 },
+    [STATS_DELIVERED_BYTES] = { "spotifs_delivered_bytes_total", "PCM data delivered by libspotify.", NULL, 1 },
+    [STATS_DELIVERED_NS] = { "spotifs_delivered_audio_seconds_total", "Duration of audio delivered by libspotify.", NULL, 1e-9 },
+    [STATS_PLAYER_NS] = { "spotifs_player_seconds_total", "Time the player was streaming, without the running stream.", NULL, 1e-9 },
+    [STATS_CACHE_HITS] = { "spotifs_cache_lookups_total", "Tracks opened with the cache enabled and listings requested.", "cache=\"pcm\",result=\"hit\"", 1 },
+    [STATS_CACHE_PARTIAL] = { "spotifs_cache_lookups_total", NULL, "cache=\"pcm\",result=\"partial\"", 1 },
+    [STATS_CACHE_MISSES] = { "spotifs_cache_lookups_total", NULL, "cache=\"pcm\",result=\"miss\"", 1 },
+    [STATS_LISTING_HITS] = { "spotifs_cache_lookups_total", NULL, "cache=\"listing\",result=\"hit\"", 1 },
+    [STATS_LISTING_MISSES] = { "spotifs_cache_lookups_total", NULL, "cache=\"listing\",result=\"miss\"", 1 },
+};
+
+uint64_t stats_clock()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* thread exits, its counters stay in the slot */
+static void release_slot(void* slot)
+{
+    __atomic_store_n(&((struct stats_slot*)slot)->used, 0, __ATOMIC_RELEASE);
+}
+
+static void create_slot_key()
+{
+    pthread_key_create(&g_slot_key, release_slot);
+}
+
+static struct stats_slot* take_slot()
+{
+    struct stats_slot* slot;
+
+    pthread_once(&g_slot_key_once, create_slot_key);
+    pthread_mutex_lock(&g_slots_lock);
+
+    for (slot = g_slots; slot && __atomic_load_n(&slot->used, __ATOMIC_ACQUIRE); slot = slot->next);
+
+    if (!slot && (slot = calloc(1, sizeof(struct stats_slot)))) {
+        slot->next = g_slots;
+        g_slots = slot;
+    }
+
+    if (slot) {
+        slot->used = 1;
+        pthread_setspecific(g_slot_key, slot);
+    }
+
+    pthread_mutex_unlock(&g_slots_lock);
+
+    return t_slot = slot;
+}
+
+void stats_add(int counter, uint64_t value)
+{
+    struct stats_slot* slot = t_slot ? t_slot : take_slot();
+
+    /* only the owner writes, readers just must not see torn values */
+    if (slot) {
+        __atomic_store_n(&slot->counters[counter], slot->counters[counter] + value, __ATOMIC_RELAXED);
+    }
+}
+
+uint64_t stats_value(int counter)
+{
+    struct stats_slot* slot;
+    uint64_t value = 0;
+
+    pthread_mutex_lock(&g_slots_lock);
+
+    for (slot = g_slots; slot; slot = slot->next) {
+        value += __atomic_load_n(&slot->counters[counter], __ATOMIC_RELAXED);
+    }
+
+    pthread_mutex_unlock(&g_slots_lock);
+
+    return value;
+}
+
+void stats_op(int op, int result, uint64_t ns)
+{
+    stats_add(STATS_OPS + op, 1);
+    stats_add(STATS_OP_NS + op, ns);
+
+    if (result < 0) {
+        stats_add(STATS_OP_ERRORS + op, 1);
+    } else if (result > 0) {
+        stats_add(STATS_OP_BYTES + op, result);
+    }
+}
+
+void stats_describe(GString* out, const char* name, const char* type, const char* help)
+{
+    g_string_append_printf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+void stats_append_label(GString* out, const char* value)
+{
+    for (; *value; value++) {
+        if (*value == '\\' || *value == '"') {
+            g_string_append_c(out, '\\');
+            g_string_append_c(out, *value);
+        } else if (*value == '\n') {
+            g_string_append(out, "\\n");
+        } else {
+            g_string_append_c(out, *value);
+        }
+    }
+}
+
+/* counters are written exactly, scaled ones as seconds */
+static void write_value(GString* out, uint64_t value, double scale)
+{
+    if (scale == 1) {
+        g_string_append_printf(out, " %" PRIu64 "\n", value);
+    } else {
+        g_string_append_printf(out, " %.6f\n", value * scale);
+    }
+}
+
+/* one sample of the metric per operation */
+static void write_ops(GString* out, int counter, const char* name, double scale)
+{
+    int op;
+
+    for (op = TRACE_LOOKUP; op < TRACE_NUM_OPS; op++) {
+        g_string_append_printf(out, "%s{op=\"%s\"}", name, g_op_names[op]);
+        write_value(out, stats_value(counter + op), scale);
+    }
+}
+
+static void write_memory(GString* out)
+{
+    unsigned long size, resident;
+    const long page = sysconf(_SC_PAGESIZE);
+    FILE* statm;
+
+    if (!(statm = fopen("/proc/self/statm", "r"))) {
+        return;
+    }
+
+    if (fscanf(statm, "%lu %lu", &size, &resident) == 2) {
+        stats_describe(out, "process_virtual_memory_bytes", "gauge", "Virtual memory size in bytes.");
+        g_string_append_printf(out, "process_virtual_memory_bytes %lu\n", size * page);
+        stats_describe(out, "process_resident_memory_bytes", "gauge", "Resident memory size in bytes.");
+        g_string_append_printf(out, "process_resident_memory_bytes %lu\n", resident * page);
+    }
+
+    fclose(statm);
+}
+
+void stats_write(GString* out)
+{
+    int counter;
+
+    stats_describe(out, "spotifs_operation_duration_seconds", "summary", "FUSE operations and time from request to reply.");
+    write_ops(out, STATS_OP_NS, "spotifs_operation_duration_seconds_sum", 1e-9);
+    write_ops(out, STATS_OPS, "spotifs_operation_duration_seconds_count", 1);
+    stats_describe(out, "spotifs_operation_errors_total", "counter", "FUSE operations replied with an error.");
+    write_ops(out, STATS_OP_ERRORS, "spotifs_operation_errors_total", 1);
+    stats_describe(out, "spotifs_operation_bytes_total", "counter", "Bytes replied by FUSE operations.");
+    write_ops(out, STATS_OP_BYTES, "spotifs_operation_bytes_total", 1);
+
+    for (counter = STATS_SPLICED_BYTES; counter < STATS_NUM_COUNTERS; counter++) {
+        if (g_counters[counter].help) {
+            stats_describe(out, g_counters[counter].name, "counter", g_counters[counter].help);
+        }
+
+        g_string_append(out, g_counters[counter].name);
+
+        if (g_counters[counter].labels) {
+            g_string_append_printf(out, "{%s}", g_counters[counter].labels);
+        }
+
+        write_value(out, stats_value(counter), g_counters[counter].scale);
+    }
+
+    write_memory(out);
+}
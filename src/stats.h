@@ -0,0 +1,59 @@
+#ifndef SPOTIFS_STATS_H
+#define SPOTIFS_STATS_H
+
+#include <stdint.h>
+#include <glib.h>
+#include "trace.h"
+
+/*
+ * counters of served operations and streaming, shown in /.stats. Every
+ * thread adds to its own slot without locking or atomic read-modify-write,
+ * readers sum the slots. Slots of exited threads are reused, so totals
+ * never go back.
+ */
+
+enum stats_counter
+{
+    /* per operation, indexed by enum trace_op */
+    STATS_OPS = 0,
+    STATS_OP_ERRORS = STATS_OPS + TRACE_NUM_OPS,
+    /* bytes replied by reads and readdirs */
+    STATS_OP_BYTES = STATS_OP_ERRORS + TRACE_NUM_OPS,
+    STATS_OP_NS = STATS_OP_BYTES + TRACE_NUM_OPS,
+
+    /* part of read bytes spliced from cache files */
+    STATS_SPLICED_BYTES = STATS_OP_NS + TRACE_NUM_OPS,
+    /* times readers waited for delivery and time they spent waiting */
+    STATS_READ_WAITS,
+    STATS_READ_WAIT_NS,
+    /* PCM delivered by libspotify, its duration and time the player was streaming */
+    STATS_DELIVERED_BYTES,
+    STATS_DELIVERED_NS,
+    STATS_PLAYER_NS,
+    /* tracks opened from complete cache files, with cached beginning or not cached */
+    STATS_CACHE_HITS,
+    STATS_CACHE_PARTIAL,
+    STATS_CACHE_MISSES,
+    /* readdirs served from serialized listings or serializing them */
+    STATS_LISTING_HITS,
+    STATS_LISTING_MISSES,
+    STATS_NUM_COUNTERS
+};
+
+/* CLOCK_MONOTONIC in ns */
+uint64_t stats_clock();
+
+void stats_add(int counter, uint64_t value);
+/* sum of all threads */
+uint64_t stats_value(int counter);
+/* operation finished with result (bytes or negative errno) after ns */
+void stats_op(int op, int result, uint64_t ns);
+
+/* append all counters and process memory in Prometheus text format */
+void stats_write(GString* out);
+/* HELP and TYPE lines of a metric */
+void stats_describe(GString* out, const char* name, const char* type, const char* help);
+/* append label value escaped for the text format */
+void stats_append_label(GString* out, const char* value);
+
+#endif // SPOTIFS_STATS_H
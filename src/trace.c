@@ -0,0 +1,158 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#include <glib.h>
+#include "trace.h"
+#include "inode.h"
+
+/* records are written in large blocks, the last one is lost on crash */
+#define TRACE_BUFFER_SIZE (1024 * 1024)
+
+static FILE* g_trace = NULL;
+static uint64_t g_trace_start = 0;
+/* inodes whose path was already written */
+static GHashTable* g_traced_inodes = NULL;
+static pthread_mutex_t g_trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int g_num_threads = 0;
+static __thread int t_thread = -1;
+
+static uint64_t monotonic_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int trace_open(const char* path)
+{
+    struct trace_header header;
+
+    if (!(g_trace = fopen(path, "wb"))) {
+        g_warning("%s: can't create '%s': %s", __func__, path, strerror(errno));
+        return -1;
+    }
+
+    setvbuf(g_trace, NULL, _IOFBF, TRACE_BUFFER_SIZE);
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.version = TRACE_VERSION;
+    header.record_size = sizeof(struct trace_record);
+    fwrite(&header, sizeof(header), 1, g_trace);
+
+    g_traced_inodes = g_hash_table_new(g_direct_hash, g_direct_equal);
+    g_trace_start = monotonic_ns();
+
+    return 0;
+}
+
+void trace_close()
+{
+    pthread_mutex_lock(&g_trace_lock);
+
+    if (g_trace) {
+        fclose(g_trace);
+        g_trace = NULL;
+        g_hash_table_destroy(g_traced_inodes);
+        g_traced_inodes = NULL;
+    }
+
+    pthread_mutex_unlock(&g_trace_lock);
+}
+
+void trace_begin(struct trace_start* start)
+{
+    /* taken also without tracing, latency is counted in stats */
+    start->time = monotonic_ns();
+    start->thread = -1;
+
+    if (!g_trace) {
+        return;
+    }
+
+    if (t_thread < 0) {
+        t_thread = __atomic_fetch_add(&g_num_threads, 1, __ATOMIC_RELAXED);
+    }
+
+    start->thread = t_thread;
+}
+
+static void write_record(struct trace_record* record, const char* name)
+{
+    record->name_length = name ? strlen(name) : 0;
+
+    fwrite(record, sizeof(struct trace_record), 1, g_trace);
+
+    if (record->name_length) {
+        fwrite(name, record->name_length, 1, g_trace);
+    }
+}
+
+/* g_trace_lock must be held */
+static void write_path(uint64_t ino, uint64_t time)
+{
+    struct trace_record record;
+    char path[PATH_MAX];
+
+    if (!ino || g_hash_table_contains(g_traced_inodes, GSIZE_TO_POINTER(ino)) || inode_path(ino, path, sizeof(path)) < 0) {
+        return;
+    }
+
+    g_hash_table_insert(g_traced_inodes, GSIZE_TO_POINTER(ino), GSIZE_TO_POINTER(ino));
+
+    memset(&record, 0, sizeof(record));
+    record.op = TRACE_PATH;
+    record.time = time;
+    record.ino = ino;
+    write_record(&record, path);
+}
+
+void trace_forget(uint64_t ino)
+{
+    pthread_mutex_lock(&g_trace_lock);
+
+    /* path is written again when the number is reused */
+    if (g_trace) {
+        g_hash_table_remove(g_traced_inodes, GSIZE_TO_POINTER(ino));
+    }
+
+    pthread_mutex_unlock(&g_trace_lock);
+}
+
+void trace_op(int op, uint64_t ino, const char* name, off_t offset, size_t size, int result, const struct trace_start* start)
+{
+    struct trace_record record;
+    uint64_t now;
+
+    /* trace started after the operation was received */
+    if (start->thread < 0) {
+        return;
+    }
+
+    now = monotonic_ns();
+
+    memset(&record, 0, sizeof(record));
+    record.op = op;
+    record.time = start->time - g_trace_start;
+    record.thread = start->thread;
+    record.ino = ino;
+    record.offset = offset;
+    record.size = size;
+    record.result = result;
+    record.latency = (now - start->time) / 1000;
+
+    pthread_mutex_lock(&g_trace_lock);
+
+    if (g_trace) {
+        write_path(ino, record.time);
+        write_record(&record, name);
+    }
+
+    pthread_mutex_unlock(&g_trace_lock);
+}
@@ -0,0 +1,79 @@
+#ifndef SPOTIFS_TRACE_H
+#define SPOTIFS_TRACE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * binary trace of filesystem operations, replayed by bench/trace_replay.
+ * File starts with trace_header followed by trace_records, a record is
+ * followed by name_length bytes of its name (not terminated). The first
+ * time an inode appears, TRACE_PATH record with its full path is written
+ * before it. Forgotten numbers are reused, then the number gets another
+ * TRACE_PATH record. Values are in host byte order.
+ */
+
+#define TRACE_MAGIC "SPFSTRC1"
+#define TRACE_VERSION 1
+
+enum trace_op
+{
+    /* ino has path given by name */
+    TRACE_PATH = 0,
+    /* ino is the parent, name is looked up */
+    TRACE_LOOKUP,
+    TRACE_GETATTR,
+    /* result is number of bytes of entries replied */
+    TRACE_READDIR,
+    TRACE_OPEN,
+    TRACE_RELEASE,
+    /* result is number of bytes read */
+    TRACE_READ,
+    TRACE_NUM_OPS
+};
+
+struct trace_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+};
+
+struct trace_record
+{
+    /* when the operation was received, ns since the trace started */
+    uint64_t time;
+    uint64_t ino;
+    uint64_t offset;
+    uint32_t size;
+    /* 0, number of bytes or negative errno */
+    int32_t result;
+    /* from receiving the request to the reply, in us */
+    uint32_t latency;
+    uint32_t name_length;
+    /* index of the FUSE thread, in order of their first operation */
+    uint16_t thread;
+    uint8_t op;
+    uint8_t reserved[5];
+};
+
+/* start writing trace into path, returns -1 if it can't be created */
+int trace_open(const char* path);
+void trace_close();
+
+/* operation taken when it's received, it can be finished by another thread */
+struct trace_start
+{
+    /* CLOCK_MONOTONIC in ns, taken also when tracing is off */
+    uint64_t time;
+    /* -1 when tracing is off */
+    int thread;
+};
+
+void trace_begin(struct trace_start* start);
+/* record operation received at start, name can be NULL */
+void trace_op(int op, uint64_t ino, const char* name, off_t offset, size_t size, int result, const struct trace_start* start);
+/* kernel forgot the inode, its number can get another path */
+void trace_forget(uint64_t ino);
+
+#endif // SPOTIFS_TRACE_H
@@ -1,5 +1,6 @@
 #include "wave.h"
 #include <assert.h>
+#include <string.h>
 
 struct wave_header
 {
@@ -18,7 +19,7 @@ struct wave_header
     int32_t datasize;
 } __attribute__((packed));
 
-static struct wave_header static_header = {
+static const struct wave_header static_header = {
         .mark = {'R', 'I', 'F', 'F'},
         // .filesize - set in spotifs_read
         .wave = {'W', 'A', 'V', 'E'},
@@ -39,12 +40,13 @@ size_t wave_header_size()
     return sizeof(static_header);
 }
 
-const char* wave_standard_header(int32_t data_size)
+void wave_standard_header(int32_t data_size, char* header)
 {
-    static_header.datasize = data_size;
-    static_header.overall_size = data_size + wave_header_size() - 8;
+    struct wave_header* out = (struct wave_header*)header;
 
-    return (const char*)&static_header;
+    memcpy(out, &static_header, sizeof(static_header));
+    out->datasize = data_size;
+    out->overall_size = data_size + wave_header_size() - 8;
 }
 
 size_t wave_size(int bytes, int channels, int rate, int ms)
@@ -52,3 +54,15 @@ size_t wave_size(int bytes, int channels, int rate, int ms)
     assert (!(ms % 1000));
     return bytes * channels * rate * (ms / 1000);
 }
+
+int wave_offset_to_ms(int bytes, int channels, int rate, size_t offset)
+{
+    const uint64_t frame = offset / (bytes * channels);
+    return (int)(frame * 1000 / rate);
+}
+
+size_t wave_ms_to_offset(int bytes, int channels, int rate, int ms)
+{
+    const uint64_t frame = (uint64_t)ms * rate / 1000;
+    return frame * bytes * channels;
+}
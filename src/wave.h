@@ -6,6 +6,14 @@
 
 size_t wave_header_size();
 size_t wave_size(int bytes, int channels, int rate, int ms);
-const char* wave_standard_header(int32_t data_size);
+/* write standard header to given buffer of wave_header_size() bytes */
+void wave_standard_header(int32_t data_size, char* header);
+
+/*
+ * convert between position in PCM data (in bytes) and track time, offsets
+ * returned by wave_ms_to_offset are always aligned to the frame boundary
+ */
+int wave_offset_to_ms(int bytes, int channels, int rate, size_t offset);
+size_t wave_ms_to_offset(int bytes, int channels, int rate, int ms);
 
 #endif //SPOTIFS_WAVE_H
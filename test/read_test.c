@@ -0,0 +1,176 @@
+/*
+ * Reads of a streamed track against the mock libspotify. Readers at
+ * distant offsets of one track make the player seek back and forth, all of
+ * them have to get whole ranges they asked for without hanging, holding
+ * samples of their own position.
+ *
+ * usage: read_test    (exits with 0 on success)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
+#include "sfs.h"
+#include "spotify.h"
+#include "wave.h"
+
+/* whole test is failed when a reader hangs */
+#define TIMEOUT_S 60
+
+#define NUM_READERS 2
+#define READ_SIZE (128 * 1024)
+#define READS_PER_READER 16
+/* time between starting readers, previous one is waiting for data by then */
+#define READER_DELAY_MS 100
+
+/* mock id of the first track of the first playlist */
+#define TRACK_ID 0
+
+struct reader
+{
+    struct spotifs_context* ctx;
+    struct track* track;
+    off_t offset;
+    int failed;
+};
+
+/* compare with samples the mock generates for the track, offset is in the file */
+static int check_samples(const char* buffer, off_t offset, size_t size)
+{
+    size_t i;
+
+    for (i = 0; i < size; i++) {
+        const off_t pcm = offset + (off_t)i - wave_header_size();
+        const int16_t left = (int16_t)((pcm / 4) * 31 + TRACK_ID * 7919);
+        const int16_t samples[2] = { left, (int16_t)~left };
+
+        if (buffer[i] != ((const char*)samples)[pcm % 4]) {
+            fprintf(stderr, "sample at %lld differs\n", (long long)(offset + i));
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static void* read_thread(void* arg)
+{
+    struct reader* reader = arg;
+    char* buffer = malloc(READ_SIZE);
+    int i, ret;
+
+    for (i = 0; buffer && i < READS_PER_READER; i++) {
+        const off_t offset = reader->offset + (off_t)i * READ_SIZE;
+
+        if ((ret = spotify_read(reader->ctx, reader->track, offset, READ_SIZE, buffer, 0)) != READ_SIZE) {
+            fprintf(stderr, "read at %lld returned %d\n", (long long)offset, ret);
+            reader->failed = 1;
+            break;
+        }
+
+        if (!check_samples(buffer, offset, READ_SIZE)) {
+            reader->failed = 1;
+            break;
+        }
+    }
+
+    free(buffer);
+    return NULL;
+}
+
+/* first track of the first playlist, opened for buffering */
+static struct track* open_track(struct spotifs_context* ctx)
+{
+    struct sfs_entry *library, *playlist;
+    struct track* track = NULL;
+    char path[PATH_MAX];
+    int i;
+
+    for (i = 0; i < TIMEOUT_S * 10; i++) {
+        spotify_lock_directory(0);
+        library = spotify_get_playlists();
+        playlist = library && library->num_children ? library->child_array[0] : NULL;
+
+        if (playlist) {
+            snprintf(path, sizeof(path), "/library/%s", playlist->name);
+        }
+
+        spotify_unlock_directory();
+
+        if (playlist) {
+            break;
+        }
+
+        usleep(100000);
+    }
+
+    if (!playlist) {
+        return NULL;
+    }
+
+    playlist = spotify_lookup(ctx, path, SPOTIFY_LOOKUP_LIST | SPOTIFY_LOOKUP_WRITE);
+
+    /* reference is taken with the lock held, as when a file is opened */
+    if (playlist && playlist->num_children) {
+        track = playlist->child_array[0]->track;
+        __atomic_add_fetch(&track->refs, 1, __ATOMIC_RELAXED);
+    }
+
+    spotify_unlock_directory();
+
+    return track && spotify_buffer_track(ctx, track) == 0 ? track : NULL;
+}
+
+int main(int argc, char** argv)
+{
+    struct spotifs_context ctx;
+    struct reader readers[NUM_READERS];
+    pthread_t threads[NUM_READERS];
+    struct track* track;
+    int i, failed = 0;
+
+    /* fast enough to reach the end of the track soon, slow enough for readers to overlap */
+    setenv("MOCK_SPOTIFY_SPEED", "20", 0);
+    setenv("MOCK_SPOTIFY_PLAYLISTS", "1", 0);
+    setenv("MOCK_SPOTIFY_TRACKS", "1", 0);
+    setenv("MOCK_SPOTIFY_TRACK_MS", "60000", 0);
+
+    alarm(TIMEOUT_S);
+
+    memset(&ctx, 0, sizeof(ctx));
+    pthread_mutex_init(&ctx.lock, NULL);
+
+    if (spotify_connect(&ctx, "user", "password") != 1) {
+        fprintf(stderr, "login failed\n");
+        return 1;
+    }
+
+    if (!(track = open_track(&ctx))) {
+        fprintf(stderr, "can't open track\n");
+        return 1;
+    }
+
+    /* far apart, so each of them needs the player seeked to its position.
+     * Later readers are further, the earlier ones are left behind the stream. */
+    for (i = 0; i < NUM_READERS; i++) {
+        readers[i].ctx = &ctx;
+        readers[i].track = track;
+        readers[i].offset = wave_header_size() + wave_size(2, 2, 44100, 5000 + i * 30000) + 1;
+        readers[i].failed = 0;
+
+        pthread_create(&threads[i], NULL, read_thread, &readers[i]);
+        usleep(READER_DELAY_MS * 1000);
+    }
+
+    for (i = 0; i < NUM_READERS; i++) {
+        pthread_join(threads[i], NULL);
+        failed |= readers[i].failed;
+    }
+
+    printf("%s\n", failed ? "FAILED" : "OK");
+
+    return failed;
+}